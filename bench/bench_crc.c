@@ -0,0 +1,91 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Throughput of lfs_crc against the nibble-table CRC littlefs ships with, at littlefs-sized buffers.
+//
+// usage: make bench-crc && ./bench-crc [MiB per size]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lfs/lfs_util.h"
+
+static uint32_t nibble_crc(uint32_t crc, const void *buffer, size_t size)
+{
+    static const uint32_t rtable[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    const uint8_t *data = buffer;
+
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc >> 4) ^ rtable[(crc ^ (data[i] >> 0)) & 0xf];
+        crc = (crc >> 4) ^ rtable[(crc ^ (data[i] >> 4)) & 0xf];
+    }
+
+    return crc;
+}
+
+static double now(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns MiB/s, the result goes to sink so that the calls are not optimized out.
+static double measure(uint32_t (*crc)(uint32_t, const void *, size_t), const uint8_t *data, size_t size,
+                      size_t total, uint32_t *sink)
+{
+    size_t rounds = total / size;
+    uint32_t value = 0xFFFFFFFF;
+
+    double start = now();
+    for (size_t round = 0; round < rounds; round++) {
+        value = crc(value, data, size);
+    }
+    double elapsed = now() - start;
+
+    *sink ^= value;
+    return (double)rounds * size / (1 << 20) / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = {8, 16, 64, 256, 4096, 65536};
+    static uint8_t data[65536];
+
+    size_t total = (argc > 1 ? strtoul(argv[1], NULL, 10) : 256) << 20;
+    uint32_t sink = 0;
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = rand();
+    }
+
+    printf("%8s %14s %14s %8s\n", "size", "nibble MiB/s", "lfs_crc MiB/s", "speedup");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double nibble = measure(nibble_crc, data, sizes[i], total / 8, &sink);
+        double current = measure(lfs_crc, data, sizes[i], total, &sink);
+        printf("%8zu %14.1f %14.1f %7.1fx\n", sizes[i], nibble, current, current / nibble);
+    }
+
+    return sink == 0x12345678 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
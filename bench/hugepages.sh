@@ -0,0 +1,57 @@
+#!/bin/sh
+# Copyright 2019 Sergey Tyultyaev
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Builds the same in-memory image with huge and with normal pages and prints the build times.
+#
+# usage: bench/hugepages.sh [image MiB] [runs]
+
+set -e
+
+TOOL=${TOOL:-./lfs-tool}
+SIZE_MB=${1:-512}
+RUNS=${2:-3}
+BLOCKS=$((SIZE_MB * 256))
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# a few large files for CTZ lists and many small ones for metadata compaction
+mkdir -p "$WORK/src"
+for d in $(seq 1 16); do
+    mkdir -p "$WORK/src/dir$d"
+    head -c $((SIZE_MB * 1024 * 1024 / 64)) /dev/urandom > "$WORK/src/dir$d/large"
+    for f in $(seq 1 200); do
+        head -c $((f * 37)) /dev/urandom > "$WORK/src/dir$d/small$f"
+    done
+done
+
+now() {
+    date +%s.%N
+}
+
+for run in $(seq 1 "$RUNS"); do
+    for pages in huge normal; do
+        start=$(now)
+        "$TOOL" -i "$WORK/image" -d "$WORK/src" -c -a "$BLOCKS" --backend ram --pages "$pages" --sync none > /dev/null
+        end=$(now)
+        echo "$pages $start $end"
+    done
+done | awk -v size="$SIZE_MB" '
+    { time[$1] += $3 - $2; runs[$1]++ }
+    END {
+        for (pages in time) {
+            printf "%s MiB image, %-6s pages: %.3f s average over %d runs\n", size, pages, time[pages] / runs[pages], runs[pages]
+        }
+    }'
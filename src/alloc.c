@@ -0,0 +1,65 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "alloc.h"
+
+#include <stdint.h>
+
+// the shortest run the file being written did not find, 0 when none
+static lfs_size_t m_missed = 0;
+
+bool alloc_contiguous(struct lfs *lfs, lfs_block_t head, lfs_size_t count, lfs_block_t *block)
+{
+    lfs_block_t block_count = lfs->cfg->block_count;
+
+    // new files start at the next free block
+    if (count == 0) {
+        m_missed = 0;
+        return false;
+    }
+
+    if (lfs_alloc_isfree(lfs, head + 1)) {
+        *block = head + 1;
+        return true;
+    }
+
+    // blocks are hardly ever freed while a file is written, a longer run will not show up either
+    if (m_missed != 0 && count >= m_missed) {
+        return false;
+    }
+
+    // the first run after the file, runs do not wrap around the end of the device
+    lfs_block_t start = 0;
+    lfs_size_t run = 0;
+    for (uint64_t i = 1; i <= block_count; i++) {
+        lfs_block_t candidate = (head + i) % block_count;
+        if (!lfs_alloc_isfree(lfs, candidate)) {
+            run = 0;
+            continue;
+        }
+        if (run == 0 || candidate == 0) {
+            run = 0;
+            start = candidate;
+        }
+        if (++run >= count) {
+            *block = start;
+            return true;
+        }
+    }
+
+    m_missed = count;
+    return false;
+}
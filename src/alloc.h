@@ -0,0 +1,23 @@
+// Copyright 2019 Sergey Tyultyaev
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "lfs/lfs.h"
+
+// littlefs alloc hook that keeps each file in runs of consecutive blocks. A file goes on right after its last block,
+// or else moves to a free run at least as long as the file so far, so that it breaks into few runs.
+bool alloc_contiguous(struct lfs *lfs, lfs_block_t head, lfs_size_t count, lfs_block_t *block);
@@ -0,0 +1,73 @@
+// Copyright 2019 Sergey Tyultyaev
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef enum {
+    BD_TYPE_DEFAULT = 0,
+    BD_TYPE_STDIO,
+    BD_TYPE_FILE,
+    BD_TYPE_MMAP,
+    BD_TYPE_RAM,
+    BD_TYPE_URING,
+    BD_TYPE_DIRECT
+} bd_type_t;
+
+typedef enum {
+    BD_MODE_READ = 0,
+    BD_MODE_CREATE, // new image, the file ends with the device
+    BD_MODE_UPDATE  // the device is a region of an existing file, bytes around it are left alone
+} bd_mode_t;
+
+typedef enum {
+    BD_SYNC_FLUSH = 0, // hand buffered writes over to the OS
+    BD_SYNC_DATA,      // flush and fdatasync
+    BD_SYNC_FULL       // flush and fsync
+} bd_sync_t;
+
+// Block device backing an lfs image. Offsets are relative to the start of the block.
+struct bd
+{
+    void *opaque;
+    // position of block 0 in the image file
+    uint64_t offset;
+    size_t block_size;
+    size_t block_count;
+    int (*read)(struct bd *bd, uint32_t block, uint32_t off, void *buffer, size_t size);
+    int (*prog)(struct bd *bd, uint32_t block, uint32_t off, const void *buffer, size_t size);
+    int (*erase)(struct bd *bd, uint32_t block);
+    // Optional, erases the whole device with bulk writes.
+    int (*fill)(struct bd *bd);
+    // Optional, hints that count blocks starting at block will be read soon.
+    int (*advise)(struct bd *bd, uint32_t block, uint32_t count);
+    int (*sync)(struct bd *bd, bd_sync_t level);
+    // Optional, drops any output still pending so that close() leaves the target untouched.
+    int (*discard)(struct bd *bd);
+    int (*close)(struct bd *bd);
+};
+
+static inline int bd_open_flags(bd_mode_t mode)
+{
+    return mode == BD_MODE_READ ? O_RDONLY : mode == BD_MODE_CREATE ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+}
+
+static inline uint64_t bd_position(const struct bd *bd, uint32_t block, uint32_t off)
+{
+    return bd->offset + (uint64_t)bd->block_size * block + off;
+}
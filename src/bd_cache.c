@@ -0,0 +1,460 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bd_cache.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+
+#define NONE UINT32_MAX
+
+// A cached block. Only the [lo, hi) range differs from the underlying device.
+struct entry
+{
+    uint32_t block;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t lo;
+    uint32_t hi;
+    uint8_t *data;
+};
+
+struct bd_context
+{
+    struct bd *bd;
+    struct entry *entries;
+    uint32_t count;
+    uint8_t *data;
+    // block -> entry, NONE when not cached
+    uint32_t *map;
+    // most recently used first
+    uint32_t head;
+    uint32_t tail;
+    uint32_t used;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writebacks;
+    // read-ahead, in blocks, 0 when off
+    uint32_t window;
+    // last consumed block
+    uint32_t stream;
+    int dir;
+    uint32_t run;
+    uint32_t prefetched;
+};
+
+static struct bd_context m_context = {0};
+
+static bool is_dirty(const struct entry *entry)
+{
+    return entry->lo < entry->hi;
+}
+
+static void lru_unlink(struct bd_context *context, uint32_t index)
+{
+    struct entry *entry = &context->entries[index];
+
+    if (entry->prev != NONE) {
+        context->entries[entry->prev].next = entry->next;
+    } else {
+        context->head = entry->next;
+    }
+    if (entry->next != NONE) {
+        context->entries[entry->next].prev = entry->prev;
+    } else {
+        context->tail = entry->prev;
+    }
+}
+
+static void lru_push(struct bd_context *context, uint32_t index)
+{
+    struct entry *entry = &context->entries[index];
+
+    entry->prev = NONE;
+    entry->next = context->head;
+    if (context->head != NONE) {
+        context->entries[context->head].prev = index;
+    }
+    context->head = index;
+    if (context->tail == NONE) {
+        context->tail = index;
+    }
+}
+
+static void lru_append(struct bd_context *context, uint32_t index)
+{
+    struct entry *entry = &context->entries[index];
+
+    entry->prev = context->tail;
+    entry->next = NONE;
+    if (context->tail != NONE) {
+        context->entries[context->tail].next = index;
+    }
+    context->tail = index;
+    if (context->head == NONE) {
+        context->head = index;
+    }
+}
+
+static int writeback(struct bd_context *context, struct entry *entry)
+{
+    int result = 0;
+
+    if (!is_dirty(entry)) {
+        goto done;
+    }
+
+    int err = context->bd->prog(context->bd, entry->block, entry->lo, entry->data + entry->lo, entry->hi - entry->lo);
+    CHECK_ERROR(err == 0, -1, "bd->prog() failed: %d", err);
+
+    context->writebacks++;
+    entry->lo = context->bd->block_size;
+    entry->hi = 0;
+
+done:
+    return result;
+}
+
+// Takes over the least recently used slot for block, loading it from the device when asked to.
+static struct entry *insert(struct bd_context *context, uint32_t block, bool load)
+{
+    struct entry *result = NULL;
+
+    uint32_t index = NONE;
+
+    if (context->used < context->count) {
+        index = context->used++;
+    } else {
+        index = context->tail;
+        int err = writeback(context, &context->entries[index]);
+        CHECK_ERROR(err == 0, NULL, "writeback() failed: %d", err);
+        lru_unlink(context, index);
+        if (context->entries[index].block != NONE) {
+            context->map[context->entries[index].block] = NONE;
+        }
+    }
+
+    struct entry *entry = &context->entries[index];
+    entry->block = block;
+    entry->lo = context->bd->block_size;
+    entry->hi = 0;
+
+    if (load) {
+        int err = context->bd->read(context->bd, block, 0, entry->data, context->bd->block_size);
+        if (err != 0) {
+            // keep the slot, unmapped, as the next one to be reused
+            entry->block = NONE;
+            lru_append(context, index);
+            CHECK_ERROR(false, NULL, "bd->read() failed: %d", err);
+        }
+    }
+
+    context->map[block] = index;
+    lru_push(context, index);
+    result = entry;
+
+done:
+    return result;
+}
+
+// Returns the entry for block, loading it from the device unless the caller overwrites it completely.
+static struct entry *lookup(struct bd_context *context, uint32_t block, bool load)
+{
+    uint32_t index = context->map[block];
+    if (index != NONE) {
+        context->hits++;
+        lru_unlink(context, index);
+        lru_push(context, index);
+        return &context->entries[index];
+    }
+
+    context->misses++;
+    return insert(context, block, load);
+}
+
+/*
+ * littlefs walks the CTZ skip-list from the file head before every new data block, and those hops only read the
+ * pointers at the start of a block. Only blocks read past their first chunk count as consumed, and read-ahead
+ * starts once consumed blocks follow each other in either direction.
+ */
+static void readahead(struct bd_context *context, uint32_t block, uint32_t off, size_t size)
+{
+    if (context->window == 0 || (off == 0 && size < context->bd->block_size) || block == context->stream) {
+        return;
+    }
+
+    if (context->dir != 0 && (int64_t)block == (int64_t)context->stream + context->dir) {
+        context->run++;
+    } else if (context->stream != NONE && (block == context->stream + 1 || block + 1 == context->stream)) {
+        context->dir = block == context->stream + 1 ? 1 : -1;
+        context->run = 1;
+    } else {
+        context->dir = 0;
+        context->run = 0;
+    }
+    context->stream = block;
+
+    if (context->run < 2) {
+        return;
+    }
+
+    for (uint32_t i = 1; i <= context->window; i++) {
+        int64_t next = (int64_t)block + context->dir * (int64_t)i;
+        if (next < 0 || next >= (int64_t)context->bd->block_count) {
+            return;
+        }
+        if (context->map[next] == NONE) {
+            if (insert(context, (uint32_t)next, true) == NULL) {
+                return;
+            }
+            context->prefetched++;
+        }
+    }
+
+    // let the kernel bring in the window after this one in the background
+    int64_t start = (int64_t)block + context->dir * (int64_t)(context->window + 1);
+    int64_t end = start + context->dir * (int64_t)(context->window - 1);
+    int64_t lo = start < end ? start : end;
+    int64_t hi = start < end ? end : start;
+    lo = lo < 0 ? 0 : lo;
+    hi = hi >= (int64_t)context->bd->block_count ? (int64_t)context->bd->block_count - 1 : hi;
+    if (context->bd->advise != NULL && lo <= hi) {
+        context->bd->advise(context->bd, (uint32_t)lo, (uint32_t)(hi - lo + 1));
+    }
+}
+
+static int bd_read(struct bd *bd, uint32_t block, uint32_t off, void *buffer, size_t size)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    struct entry *entry = lookup(context, block, true);
+    CHECK_ERROR(entry != NULL, -1, "lookup() failed");
+
+    memcpy(buffer, entry->data + off, size);
+
+    readahead(context, block, off, size);
+
+done:
+    return result;
+}
+
+static int bd_prog(struct bd *bd, uint32_t block, uint32_t off, const void *buffer, size_t size)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    struct entry *entry = lookup(context, block, off != 0 || size != bd->block_size);
+    CHECK_ERROR(entry != NULL, -1, "lookup() failed");
+
+    memcpy(entry->data + off, buffer, size);
+    entry->lo = off < entry->lo ? off : entry->lo;
+    entry->hi = off + size > entry->hi ? off + size : entry->hi;
+
+done:
+    return result;
+}
+
+static int bd_erase(struct bd *bd, uint32_t block)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    struct entry *entry = lookup(context, block, false);
+    CHECK_ERROR(entry != NULL, -1, "lookup() failed");
+
+    memset(entry->data, 0xFF, bd->block_size);
+    entry->lo = 0;
+    entry->hi = bd->block_size;
+
+done:
+    return result;
+}
+
+static int flush(struct bd_context *context)
+{
+    int result = 0;
+
+    // in block order, so the device sees mostly sequential writes
+    for (uint32_t block = 0; block < context->bd->block_count; block++) {
+        if (context->map[block] != NONE) {
+            int err = writeback(context, &context->entries[context->map[block]]);
+            CHECK_ERROR(err == 0, -1, "writeback() failed: %d", err);
+        }
+    }
+
+done:
+    return result;
+}
+
+static void invalidate(struct bd_context *context)
+{
+    for (uint32_t i = 0; i < context->used; i++) {
+        if (context->entries[i].block != NONE) {
+            context->map[context->entries[i].block] = NONE;
+        }
+    }
+    context->used = 0;
+    context->head = NONE;
+    context->tail = NONE;
+}
+
+static int bd_fill(struct bd *bd)
+{
+    struct bd_context *context = bd->opaque;
+
+    invalidate(context);
+
+    if (context->bd->fill != NULL) {
+        return context->bd->fill(context->bd);
+    }
+
+    for (uint32_t block = 0; block < bd->block_count; block++) {
+        int err = context->bd->erase(context->bd, block);
+        if (err != 0) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+static int bd_sync(struct bd *bd, bd_sync_t level)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    int err = flush(context);
+    CHECK_ERROR(err == 0, -1, "flush() failed: %d", err);
+
+    err = context->bd->sync(context->bd, level);
+    CHECK_ERROR(err == 0, -1, "bd->sync() failed: %d", err);
+
+done:
+    return result;
+}
+
+static int bd_discard(struct bd *bd)
+{
+    struct bd_context *context = bd->opaque;
+
+    invalidate(context);
+
+    return context->bd->discard != NULL ? context->bd->discard(context->bd) : 0;
+}
+
+static int bd_close(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    int err = flush(context);
+    if (err != 0) {
+        ERROR("flush() failed: %d", err);
+        result = -1;
+    }
+
+    err = context->bd->close(context->bd);
+    if (err != 0) {
+        ERROR("bd->close() failed: %d", err);
+        result = -1;
+    }
+
+    free(context->entries);
+    context->entries = NULL;
+    free(context->data);
+    context->data = NULL;
+    free(context->map);
+    context->map = NULL;
+
+    return result;
+}
+
+static struct bd m_bd_cache = {
+    .opaque = &m_context,
+    .read = bd_read,
+    .prog = bd_prog,
+    .erase = bd_erase,
+    .fill = bd_fill,
+    .sync = bd_sync,
+    .discard = bd_discard,
+    .close = bd_close
+};
+
+void bd_cache_get_stats(const struct bd *bd, struct bd_cache_stats *stats)
+{
+    const struct bd_context *context = bd->opaque;
+    stats->hits = context->hits;
+    stats->misses = context->misses;
+    stats->writebacks = context->writebacks;
+    stats->prefetched = context->prefetched;
+}
+
+struct bd *bd_cache_get(struct bd *bd, size_t budget, size_t readahead)
+{
+    struct bd *result = NULL;
+
+    CHECK_ERROR(bd != NULL, NULL, "bd == NULL");
+
+    size_t count = budget / bd->block_size;
+    count = count < bd->block_count ? count : bd->block_count;
+    CHECK_ERROR(count > 0, NULL, "cache budget is smaller than a block: %zu", budget);
+
+    memset(&m_context, 0, sizeof(m_context));
+    m_context.bd = bd;
+    m_context.count = count;
+    m_context.head = NONE;
+    m_context.tail = NONE;
+    m_context.stream = NONE;
+
+    // the block being read and the ones walked through to find it must survive a full window
+    CHECK_ERROR(readahead == 0 || readahead + 32 <= count, NULL, "cache of %zu blocks is too small for read-ahead of %zu",
+                count, readahead);
+    m_context.window = readahead;
+
+    m_context.entries = calloc(count, sizeof(*m_context.entries));
+    CHECK_ERROR(m_context.entries != NULL, NULL, "calloc() failed");
+
+    m_context.data = malloc(count * bd->block_size);
+    CHECK_ERROR(m_context.data != NULL, NULL, "malloc() failed");
+
+    m_context.map = malloc(bd->block_count * sizeof(*m_context.map));
+    CHECK_ERROR(m_context.map != NULL, NULL, "malloc() failed");
+
+    for (size_t i = 0; i < bd->block_count; i++) {
+        m_context.map[i] = NONE;
+    }
+    for (size_t i = 0; i < count; i++) {
+        m_context.entries[i].data = m_context.data + i * bd->block_size;
+    }
+
+    m_bd_cache.block_size = bd->block_size;
+    m_bd_cache.block_count = bd->block_count;
+
+    result = &m_bd_cache;
+
+done:
+    if (result == NULL) {
+        free(m_context.entries);
+        free(m_context.data);
+        free(m_context.map);
+        memset(&m_context, 0, sizeof(m_context));
+    }
+    return result;
+}
@@ -0,0 +1,32 @@
+// Copyright 2019 Sergey Tyultyaev
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "bd.h"
+
+// Wraps bd with a write-back cache of whole blocks using at most budget bytes. With readahead != 0, sequential
+// reads prefetch that many blocks ahead into the cache.
+struct bd *bd_cache_get(struct bd *bd, size_t budget, size_t readahead);
+
+struct bd_cache_stats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writebacks;
+    uint32_t prefetched;
+};
+
+// Counters of the cache, final once it is closed and kept until the next bd_cache_get().
+void bd_cache_get_stats(const struct bd *bd, struct bd_cache_stats *stats);
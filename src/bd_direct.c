@@ -0,0 +1,347 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// O_DIRECT
+#define _GNU_SOURCE
+
+#include "bd_direct.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "macro.h"
+#include "util.h"
+
+#if defined(O_DIRECT) || defined(F_NOCACHE)
+
+#define NONE UINT32_MAX
+
+// Direct I/O needs buffers, offsets and sizes aligned to the logical sector size of the device.
+#define ALIGNMENT 4096
+
+// Bounce buffer holding one whole block.
+struct buffer
+{
+    uint32_t block;
+    bool dirty;
+    uint8_t *data;
+};
+
+struct bd_context
+{
+    int fd;
+    // block being assembled from programs, written out as a whole
+    struct buffer prog;
+    // last block read
+    struct buffer read;
+    // blocks known to hold only 0xFF on the device, programs into them skip the read
+    uint32_t *erased;
+};
+
+static struct bd_context m_context = {.fd = -1};
+
+static int transfer(int fd, bool write, uint8_t *data, size_t size, off_t offset)
+{
+    int result = 0;
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes = write ? pwrite(fd, data + done, size - done, offset + done)
+                              : pread(fd, data + done, size - done, offset + done);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        CHECK_ERROR(bytes >= 0, -1, "%s() failed: offset: %lld: %s", write ? "pwrite" : "pread",
+                    (long long)(offset + done), strerror(errno));
+        CHECK_ERROR(bytes > 0, -1, "short %s: offset: %lld, size: %zu, bytes: %zu", write ? "write" : "read",
+                    (long long)offset, size, done);
+        done += bytes;
+    }
+
+done:
+    return result;
+}
+
+static int flush(struct bd *bd, struct buffer *buffer)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (buffer->block == NONE || !buffer->dirty) {
+        goto done;
+    }
+
+    int err = transfer(context->fd, true, buffer->data, bd->block_size, bd_position(bd, buffer->block, 0));
+    CHECK_ERROR(err == 0, -1, "transfer() failed: %d", err);
+
+    buffer->dirty = false;
+
+done:
+    return result;
+}
+
+// Makes buffer hold block, reading it from the device unless the caller overwrites it completely.
+static int load(struct bd *bd, struct buffer *buffer, uint32_t block, bool read)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (buffer->block == block) {
+        goto done;
+    }
+
+    int err = flush(bd, buffer);
+    CHECK_ERROR(err == 0, -1, "flush() failed: %d", err);
+
+    buffer->block = NONE;
+
+    if (read) {
+        err = transfer(context->fd, false, buffer->data, bd->block_size, bd_position(bd, block, 0));
+        CHECK_ERROR(err == 0, -1, "transfer() failed: %d", err);
+    }
+
+    buffer->block = block;
+
+done:
+    return result;
+}
+
+static int bd_read(struct bd *bd, uint32_t block, uint32_t off, void *buffer, size_t size)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (context->prog.block == block) {
+        memcpy(buffer, context->prog.data + off, size);
+        goto done;
+    }
+
+    int err = load(bd, &context->read, block, true);
+    CHECK_ERROR(err == 0, -1, "load() failed: %d", err);
+
+    memcpy(buffer, context->read.data + off, size);
+
+done:
+    return result;
+}
+
+static int bd_prog(struct bd *bd, uint32_t block, uint32_t off, const void *buffer, size_t size)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (context->read.block == block) {
+        context->read.block = NONE;
+    }
+
+    if (context->prog.block != block) {
+        bool erased = bitmap_test(context->erased, block);
+        int err = load(bd, &context->prog, block, !erased);
+        CHECK_ERROR(err == 0, -1, "load() failed: %d", err);
+        if (erased) {
+            memset(context->prog.data, 0xFF, bd->block_size);
+        }
+    }
+
+    memcpy(context->prog.data + off, buffer, size);
+    context->prog.dirty = true;
+    bitmap_clear(context->erased, block);
+
+done:
+    return result;
+}
+
+static int bd_erase(struct bd *bd, uint32_t block)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (context->read.block == block) {
+        context->read.block = NONE;
+    }
+
+    int err = load(bd, &context->prog, block, false);
+    CHECK_ERROR(err == 0, -1, "load() failed: %d", err);
+
+    memset(context->prog.data, 0xFF, bd->block_size);
+    context->prog.dirty = true;
+    bitmap_set(context->erased, block);
+
+done:
+    return result;
+}
+
+static int bd_fill(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    uint8_t *erased = NULL;
+
+    context->prog.block = NONE;
+    context->read.block = NONE;
+
+    // about 1 MiB of whole blocks per write
+    size_t blocks = (1024 * 1024 + bd->block_size - 1) / bd->block_size;
+    int err = posix_memalign((void **)&erased, ALIGNMENT, blocks * bd->block_size);
+    CHECK_ERROR(err == 0, -1, "posix_memalign() failed: %d", err);
+    memset(erased, 0xFF, blocks * bd->block_size);
+
+    for (size_t block = 0; block < bd->block_count; block += blocks) {
+        size_t count = bd->block_count - block < blocks ? bd->block_count - block : blocks;
+        err = transfer(context->fd, true, erased, count * bd->block_size, bd_position(bd, block, 0));
+        CHECK_ERROR(err == 0, -1, "transfer() failed: %d", err);
+    }
+    memset(context->erased, 0xFF, (bd->block_count + 31) / 32 * sizeof(uint32_t));
+
+done:
+    free(erased);
+    return result;
+}
+
+static int bd_sync(struct bd *bd, bd_sync_t level)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    int err = flush(bd, &context->prog);
+    CHECK_ERROR(err == 0, -1, "flush() failed: %d", err);
+
+    // O_DIRECT skips the page cache but not the volatile cache of the drive
+    if (level != BD_SYNC_FLUSH) {
+        err = sync_fd(context->fd, level == BD_SYNC_FULL);
+        CHECK_ERROR(err == 0, -1, "sync_fd() failed: %s", strerror(errno));
+    }
+
+done:
+    return result;
+}
+
+static int bd_close(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (context->fd >= 0) {
+        int err = flush(bd, &context->prog);
+        if (err != 0) {
+            ERROR("flush() failed: %d", err);
+            result = -1;
+        }
+
+        err = close(context->fd);
+        if (err != 0) {
+            ERROR("close() failed: %s", strerror(errno));
+            result = -1;
+        }
+        context->fd = -1;
+    }
+
+    free(context->prog.data);
+    context->prog.data = NULL;
+    free(context->read.data);
+    context->read.data = NULL;
+    free(context->erased);
+    context->erased = NULL;
+
+    return result;
+}
+
+static struct bd m_bd_direct = {
+    .opaque = &m_context,
+    .read = bd_read,
+    .prog = bd_prog,
+    .erase = bd_erase,
+    .fill = bd_fill,
+    .sync = bd_sync,
+    .close = bd_close
+};
+
+struct bd *bd_direct_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count)
+{
+    struct bd *result = NULL;
+
+    CHECK_ERROR(image != NULL, NULL, "image == NULL");
+    bool aligned = block_size / ALIGNMENT * ALIGNMENT == block_size;
+    CHECK_ERROR(aligned, NULL, "block size %zu is not a multiple of %d", block_size, ALIGNMENT);
+    aligned = offset / ALIGNMENT * ALIGNMENT == offset;
+    CHECK_ERROR(aligned, NULL, "offset %llu is not a multiple of %d", (unsigned long long)offset, ALIGNMENT);
+
+    m_bd_direct.offset = offset;
+    m_bd_direct.block_size = block_size;
+    m_bd_direct.block_count = block_count;
+
+    m_context.prog.block = NONE;
+    m_context.prog.dirty = false;
+    m_context.read.block = NONE;
+    m_context.read.dirty = false;
+
+    int err = posix_memalign((void **)&m_context.prog.data, ALIGNMENT, block_size);
+    CHECK_ERROR(err == 0, NULL, "posix_memalign() failed: %d", err);
+
+    err = posix_memalign((void **)&m_context.read.data, ALIGNMENT, block_size);
+    CHECK_ERROR(err == 0, NULL, "posix_memalign() failed: %d", err);
+
+    m_context.erased = bitmap_alloc(block_count, false);
+    CHECK_ERROR(m_context.erased != NULL, NULL, "bitmap_alloc() failed");
+
+    int flags = bd_open_flags(mode);
+#ifdef O_DIRECT
+    flags |= O_DIRECT;
+#endif //O_DIRECT
+
+    m_context.fd = open(image, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    CHECK_ERROR(m_context.fd >= 0, NULL, "open() failed: %s", strerror(errno));
+
+#ifdef F_NOCACHE
+    err = fcntl(m_context.fd, F_NOCACHE, 1);
+    CHECK_ERROR(err != -1, NULL, "fcntl(F_NOCACHE) failed: %s", strerror(errno));
+#endif //F_NOCACHE
+
+    if (mode == BD_MODE_CREATE) {
+        err = ftruncate(m_context.fd, offset + (off_t)block_size * block_count);
+        CHECK_ERROR(err == 0, NULL, "ftruncate() failed: %s", strerror(errno));
+    }
+
+    // some filesystems accept O_DIRECT on open and only reject the first transfer
+    err = transfer(m_context.fd, false, m_context.read.data, block_size, offset);
+    CHECK_ERROR(err == 0, NULL, "direct I/O is not supported for %s", image);
+
+    result = &m_bd_direct;
+
+done:
+    if (result == NULL) {
+        bd_close(&m_bd_direct);
+    }
+    return result;
+}
+
+#else
+
+struct bd *bd_direct_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count)
+{
+    ERROR("direct I/O backend is not supported on this platform");
+    return NULL;
+}
+
+#endif //O_DIRECT || F_NOCACHE
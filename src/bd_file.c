@@ -0,0 +1,208 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bd_file.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "util.h"
+
+#ifndef _WIN32
+
+// The descriptor is only accessed with positional I/O, so concurrent readers do not share a file offset.
+struct bd_context
+{
+    int fd;
+};
+
+static struct bd_context m_context = {.fd = -1};
+
+static int bd_read(struct bd *bd, uint32_t block, uint32_t off, void *buffer, size_t size)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    off_t offset = bd_position(bd, block, off);
+    uint8_t *data = buffer;
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t bytes = pread(context->fd, data + done, size - done, offset + done);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        CHECK_ERROR(bytes >= 0, -1, "pread() failed: block: %u, off: %u: %s", block, off, strerror(errno));
+        CHECK_ERROR(bytes > 0, -1, "short read: block: %u, off: %u, size: %zu, bytes: %zu", block, off, size, done);
+        done += bytes;
+    }
+
+done:
+    return result;
+}
+
+static int bd_prog(struct bd *bd, uint32_t block, uint32_t off, const void *buffer, size_t size)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    off_t offset = bd_position(bd, block, off);
+    const uint8_t *data = buffer;
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t bytes = pwrite(context->fd, data + done, size - done, offset + done);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        CHECK_ERROR(bytes >= 0, -1, "pwrite() failed: block: %u, off: %u: %s", block, off, strerror(errno));
+        CHECK_ERROR(bytes > 0, -1, "short write: block: %u, off: %u, size: %zu, bytes: %zu", block, off, size, done);
+        done += bytes;
+    }
+
+done:
+    return result;
+}
+
+static int bd_erase(struct bd *bd, uint32_t block)
+{
+    uint8_t erased[4096];
+    memset(erased, 0xFF, sizeof(erased));
+
+    for (size_t off = 0; off < bd->block_size; off += sizeof(erased)) {
+        size_t size = bd->block_size - off < sizeof(erased) ? bd->block_size - off : sizeof(erased);
+        int err = bd_prog(bd, block, off, erased, size);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int bd_fill(struct bd *bd)
+{
+    int result = 0;
+
+    // about 1 MiB of whole blocks per write
+    size_t blocks = (1024 * 1024 + bd->block_size - 1) / bd->block_size;
+    uint8_t *erased = malloc(blocks * bd->block_size);
+    CHECK_ERROR(erased != NULL, -1, "malloc() failed");
+    memset(erased, 0xFF, blocks * bd->block_size);
+
+    for (size_t block = 0; block < bd->block_count; block += blocks) {
+        size_t count = bd->block_count - block < blocks ? bd->block_count - block : blocks;
+        int err = bd_prog(bd, block, 0, erased, count * bd->block_size);
+        CHECK_ERROR(err == 0, -1, "bd_prog() failed: %d", err);
+    }
+
+done:
+    free(erased);
+    return result;
+}
+
+static int bd_advise(struct bd *bd, uint32_t block, uint32_t count)
+{
+    struct bd_context *context = bd->opaque;
+    return posix_fadvise(context->fd, bd_position(bd, block, 0), (off_t)bd->block_size * count, POSIX_FADV_WILLNEED) == 0
+               ? 0
+               : -1;
+}
+
+static int bd_sync(struct bd *bd, bd_sync_t level)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    // writes go straight to the kernel, there is nothing buffered to flush
+    if (level != BD_SYNC_FLUSH) {
+        int err = sync_fd(context->fd, level == BD_SYNC_FULL);
+        CHECK_ERROR(err == 0, -1, "sync_fd() failed: %s", strerror(errno));
+    }
+
+done:
+    return result;
+}
+
+static int bd_close(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (context->fd >= 0) {
+        int err = close(context->fd);
+        context->fd = -1;
+        CHECK_ERROR(err == 0, -1, "close() failed: %s", strerror(errno));
+    }
+
+done:
+    return result;
+}
+
+static struct bd m_bd_file = {
+    .opaque = &m_context,
+    .read = bd_read,
+    .prog = bd_prog,
+    .erase = bd_erase,
+    .fill = bd_fill,
+    .advise = bd_advise,
+    .sync = bd_sync,
+    .close = bd_close
+};
+
+struct bd *bd_file_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count)
+{
+    struct bd *result = NULL;
+
+    CHECK_ERROR(image != NULL, NULL, "image == NULL");
+
+    m_context.fd = open(image, bd_open_flags(mode), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    CHECK_ERROR(m_context.fd >= 0, NULL, "open() failed: %s", strerror(errno));
+
+    if (mode == BD_MODE_CREATE) {
+        int err = ftruncate(m_context.fd, offset + (off_t)block_size * block_count);
+        CHECK_ERROR(err == 0, NULL, "ftruncate() failed: %s", strerror(errno));
+    }
+
+    m_bd_file.offset = offset;
+    m_bd_file.block_size = block_size;
+    m_bd_file.block_count = block_count;
+
+    result = &m_bd_file;
+
+done:
+    if (result == NULL) {
+        bd_close(&m_bd_file);
+    }
+    return result;
+}
+
+#else
+
+struct bd *bd_file_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count)
+{
+    ERROR("file backend is not supported on this platform");
+    return NULL;
+}
+
+#endif //_WIN32
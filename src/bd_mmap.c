@@ -0,0 +1,232 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bd_mmap.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif //_WIN32
+
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif //__linux__
+
+#include "macro.h"
+#include "util.h"
+
+#ifndef _WIN32
+
+struct bd_context
+{
+    int fd;
+    // the mapping starts on the page holding block 0
+    uint8_t *map;
+    size_t map_size;
+    uint8_t *data;
+    size_t size;
+};
+
+static struct bd_context m_context = {.fd = -1};
+
+// Shared mappings of network and FUSE files are not coherent with other clients and fault with SIGBUS on errors.
+static bool is_remote(int fd)
+{
+#ifdef __linux__
+    struct statfs stat_ = {0};
+    if (fstatfs(fd, &stat_) != 0) {
+        return false;
+    }
+
+    switch ((uint32_t)stat_.f_type) {
+        case 0x6969:     // NFS_SUPER_MAGIC
+        case 0x65735546: // FUSE_SUPER_MAGIC
+        case 0x517B:     // SMB_SUPER_MAGIC
+        case 0xFF534D42: // CIFS_MAGIC_NUMBER
+        case 0xFE534D42: // SMB2_MAGIC_NUMBER
+            return true;
+        default:
+            return false;
+    }
+#else
+    return false;
+#endif //__linux__
+}
+
+static int bd_read(struct bd *bd, uint32_t block, uint32_t off, void *buffer, size_t size)
+{
+    struct bd_context *context = bd->opaque;
+    memcpy(buffer, context->data + bd->block_size * block + off, size);
+    return 0;
+}
+
+static int bd_prog(struct bd *bd, uint32_t block, uint32_t off, const void *buffer, size_t size)
+{
+    struct bd_context *context = bd->opaque;
+    memcpy(context->data + bd->block_size * block + off, buffer, size);
+    return 0;
+}
+
+static int bd_erase(struct bd *bd, uint32_t block)
+{
+    struct bd_context *context = bd->opaque;
+    memset(context->data + bd->block_size * block, 0xFF, bd->block_size);
+    return 0;
+}
+
+static int bd_fill(struct bd *bd)
+{
+    struct bd_context *context = bd->opaque;
+    memset(context->data, 0xFF, context->size);
+    return 0;
+}
+
+static int bd_advise(struct bd *bd, uint32_t block, uint32_t count)
+{
+    struct bd_context *context = bd->opaque;
+
+    // the range has to start on a page boundary
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t head = context->data - context->map;
+    size_t start = (head + bd->block_size * block) / page * page;
+    size_t end = head + bd->block_size * ((size_t)block + count);
+    end = end < context->map_size ? end : context->map_size;
+
+    return start < end && posix_madvise(context->map + start, end - start, POSIX_MADV_WILLNEED) == 0 ? 0 : -1;
+}
+
+static int bd_sync(struct bd *bd, bd_sync_t level)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    // dirty pages already belong to the page cache, a flush only schedules write back
+    int err = msync(context->map, context->map_size, level == BD_SYNC_FLUSH ? MS_ASYNC : MS_SYNC);
+    CHECK_ERROR(err == 0, -1, "msync() failed: %s", strerror(errno));
+
+    if (level == BD_SYNC_FULL) {
+        err = sync_fd(context->fd, true);
+        CHECK_ERROR(err == 0, -1, "sync_fd() failed: %s", strerror(errno));
+    }
+
+done:
+    return result;
+}
+
+static int bd_close(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (context->map != NULL) {
+        // unmapping keeps dirty pages in the page cache, durability is up to sync()
+        int err = munmap(context->map, context->map_size);
+        if (err != 0) {
+            ERROR("munmap() failed: %s", strerror(errno));
+            result = -1;
+        }
+        context->map = NULL;
+        context->data = NULL;
+    }
+
+    if (context->fd >= 0) {
+        int err = close(context->fd);
+        if (err != 0) {
+            ERROR("close() failed: %s", strerror(errno));
+            result = -1;
+        }
+        context->fd = -1;
+    }
+
+    return result;
+}
+
+static struct bd m_bd_mmap = {
+    .opaque = &m_context,
+    .read = bd_read,
+    .prog = bd_prog,
+    .erase = bd_erase,
+    .fill = bd_fill,
+    .advise = bd_advise,
+    .sync = bd_sync,
+    .close = bd_close
+};
+
+struct bd *bd_mmap_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count)
+{
+    struct bd *result = NULL;
+
+    CHECK_ERROR(image != NULL, NULL, "image == NULL");
+    CHECK_ERROR(block_count <= SIZE_MAX / block_size, NULL, "image does not fit in the address space");
+
+    m_context.size = block_size * block_count;
+
+    m_context.fd = open(image, bd_open_flags(mode), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    CHECK_ERROR(m_context.fd >= 0, NULL, "open() failed: %s", strerror(errno));
+    CHECK_ERROR(!is_remote(m_context.fd), NULL, "image is on a network or FUSE filesystem");
+
+    if (mode == BD_MODE_CREATE) {
+        int err = ftruncate(m_context.fd, offset + m_context.size);
+        CHECK_ERROR(err == 0, NULL, "ftruncate() failed: %s", strerror(errno));
+    } else {
+        // pages past the end of the file raise SIGBUS instead of a read error
+        struct stat stat_ = {0};
+        int err = fstat(m_context.fd, &stat_);
+        CHECK_ERROR(err == 0, NULL, "fstat() failed: %s", strerror(errno));
+        CHECK_ERROR((uint64_t)stat_.st_size >= offset + m_context.size, NULL, "image is too small: %lld < %llu",
+                    (long long)stat_.st_size, (unsigned long long)(offset + m_context.size));
+    }
+
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    size_t head = offset - offset / page * page;
+    m_context.map_size = head + m_context.size;
+
+    int prot = mode == BD_MODE_READ ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *map = mmap(NULL, m_context.map_size, prot, MAP_SHARED, m_context.fd, offset - head);
+    CHECK_ERROR(map != MAP_FAILED, NULL, "mmap() failed: %s", strerror(errno));
+    m_context.map = map;
+    m_context.data = m_context.map + head;
+
+    m_bd_mmap.offset = offset;
+    m_bd_mmap.block_size = block_size;
+    m_bd_mmap.block_count = block_count;
+
+    result = &m_bd_mmap;
+
+done:
+    if (result == NULL) {
+        bd_close(&m_bd_mmap);
+    }
+    return result;
+}
+
+#else
+
+struct bd *bd_mmap_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count)
+{
+    ERROR("mmap backend is not supported on this platform");
+    return NULL;
+}
+
+#endif //_WIN32
@@ -0,0 +1,199 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bd_null.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "macro.h"
+
+// room for the 32 skip-list pointers littlefs puts in front of file data
+#define DATA_HEAD 128
+
+struct bd_context
+{
+    // NULL blocks read as erased, data blocks hold DATA_HEAD bytes
+    uint8_t **blocks;
+    uint32_t *data;
+    // littlefs reads every program back to verify it, the last one on a data block is kept for that
+    uint32_t last_block;
+    uint32_t last_off;
+    size_t last_size;
+    uint8_t *last;
+    uint32_t compactions;
+};
+
+static struct bd_context m_context = {0};
+
+static size_t stored_size(struct bd *bd, uint32_t block)
+{
+    struct bd_context *context = bd->opaque;
+    return bitmap_test(context->data, block) ? (bd->block_size < DATA_HEAD ? bd->block_size : DATA_HEAD)
+                                             : bd->block_size;
+}
+
+// Copies the overlap of [off, off + size) and [start, start + length) from src to dst.
+static void copy_overlap(uint8_t *dst, uint32_t off, size_t size, const uint8_t *src, uint32_t start, size_t length)
+{
+    size_t begin = off > start ? off : start;
+    size_t end = off + size < start + length ? off + size : start + length;
+    if (begin < end) {
+        memcpy(dst + (begin - off), src + (begin - start), end - begin);
+    }
+}
+
+static int bd_read(struct bd *bd, uint32_t block, uint32_t off, void *buffer, size_t size)
+{
+    struct bd_context *context = bd->opaque;
+
+    memset(buffer, 0xFF, size);
+    if (context->blocks[block] != NULL) {
+        copy_overlap(buffer, off, size, context->blocks[block], 0, stored_size(bd, block));
+    }
+    if (context->last_size != 0 && context->last_block == block) {
+        copy_overlap(buffer, off, size, context->last, context->last_off, context->last_size);
+    }
+    return 0;
+}
+
+static int bd_prog(struct bd *bd, uint32_t block, uint32_t off, const void *buffer, size_t size)
+{
+    struct bd_context *context = bd->opaque;
+
+    size_t stored = stored_size(bd, block);
+    if (context->blocks[block] == NULL) {
+        context->blocks[block] = malloc(stored);
+        if (context->blocks[block] == NULL) {
+            ERROR("malloc() failed");
+            return -1;
+        }
+        memset(context->blocks[block], 0xFF, stored);
+    }
+    copy_overlap(context->blocks[block], 0, stored, buffer, off, size);
+
+    if (bitmap_test(context->data, block)) {
+        memcpy(context->last, buffer, size);
+        context->last_block = block;
+        context->last_off = off;
+        context->last_size = size;
+    } else if (off == 0) {
+        context->compactions++;
+    }
+    return 0;
+}
+
+static int bd_erase(struct bd *bd, uint32_t block)
+{
+    struct bd_context *context = bd->opaque;
+
+    free(context->blocks[block]);
+    context->blocks[block] = NULL;
+    bitmap_clear(context->data, block);
+    if (context->last_block == block) {
+        context->last_size = 0;
+    }
+    return 0;
+}
+
+static int bd_fill(struct bd *bd)
+{
+    for (uint32_t block = 0; block < bd->block_count; block++) {
+        bd_erase(bd, block);
+    }
+    return 0;
+}
+
+static int bd_sync(struct bd *bd, bd_sync_t level)
+{
+    return 0;
+}
+
+static int bd_close(struct bd *bd)
+{
+    struct bd_context *context = bd->opaque;
+
+    if (context->blocks != NULL) {
+        bd_fill(bd);
+    }
+    free(context->blocks);
+    context->blocks = NULL;
+    free(context->data);
+    context->data = NULL;
+    free(context->last);
+    context->last = NULL;
+    return 0;
+}
+
+static struct bd m_bd_null = {
+    .opaque = &m_context,
+    .read = bd_read,
+    .prog = bd_prog,
+    .erase = bd_erase,
+    .fill = bd_fill,
+    .sync = bd_sync,
+    .close = bd_close
+};
+
+struct bd *bd_null_get(size_t block_size, size_t block_count)
+{
+    struct bd *result = NULL;
+
+    CHECK_ERROR(block_count <= UINT32_MAX, NULL, "too many blocks: %zu", block_count);
+
+    m_bd_null.block_size = block_size;
+    m_bd_null.block_count = block_count;
+
+    m_context.last_size = 0;
+    m_context.compactions = 0;
+
+    m_context.blocks = calloc(block_count, sizeof(*m_context.blocks));
+    CHECK_ERROR(m_context.blocks != NULL, NULL, "calloc() failed");
+
+    m_context.data = bitmap_alloc(block_count, false);
+    CHECK_ERROR(m_context.data != NULL, NULL, "bitmap_alloc() failed");
+
+    m_context.last = malloc(block_size);
+    CHECK_ERROR(m_context.last != NULL, NULL, "malloc() failed");
+
+    result = &m_bd_null;
+
+done:
+    if (result == NULL) {
+        bd_close(&m_bd_null);
+    }
+    return result;
+}
+
+void bd_null_mark_data(struct bd *bd, uint32_t block)
+{
+    struct bd_context *context = bd->opaque;
+    bitmap_set(context->data, block);
+}
+
+bool bd_null_is_data(struct bd *bd, uint32_t block)
+{
+    struct bd_context *context = bd->opaque;
+    return bitmap_test(context->data, block);
+}
+
+uint32_t bd_null_compactions(struct bd *bd)
+{
+    struct bd_context *context = bd->opaque;
+    return context->compactions;
+}
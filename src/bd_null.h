@@ -0,0 +1,32 @@
+// Copyright 2019 Sergey Tyultyaev
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bd.h"
+
+// Dry-run device without an image: metadata blocks are held in memory, data blocks only keep their skip-list head.
+struct bd *bd_null_get(size_t block_size, size_t block_count);
+
+// Marks a block as file data until it is erased, programs past its head are dropped.
+void bd_null_mark_data(struct bd *bd, uint32_t block);
+
+bool bd_null_is_data(struct bd *bd, uint32_t block);
+
+// Metadata blocks programmed from the start, each one is a compaction or a new metadata pair.
+uint32_t bd_null_compactions(struct bd *bd);
@@ -0,0 +1,374 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// MAP_ANONYMOUS, MAP_HUGETLB and madvise()
+#define _GNU_SOURCE
+
+#include "bd_ram.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "util.h"
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// The whole image lives in memory and reaches the disk only on close, with a single write.
+struct bd_context
+{
+    const char *image;
+    bd_mode_t mode;
+    uint64_t offset;
+    bool discard;
+    bd_sync_t level;
+    // stdin or stdout when the image is streamed
+    int fd;
+    uint8_t *data;
+    size_t size;
+    // length of the mapping behind data
+    size_t mapped;
+};
+
+static struct bd_context m_context = {.fd = -1};
+
+static size_t round_up(size_t size, size_t align)
+{
+    return (size + align - 1) / align * align;
+}
+
+// Large images see lots of TLB misses on small pages, so huge pages are tried first:
+// explicit ones when some are reserved, otherwise transparent ones on a 2 MiB aligned mapping.
+static uint8_t *buffer_alloc(size_t size, bd_ram_pages_t pages, size_t *mapped)
+{
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    if (pages == BD_RAM_PAGES_NORMAL) {
+        *mapped = round_up(size, (size_t)sysconf(_SC_PAGESIZE));
+        void *data = mmap(NULL, *mapped, prot, flags, -1, 0);
+        return data != MAP_FAILED ? data : NULL;
+    }
+
+    *mapped = round_up(size, HUGE_PAGE_SIZE);
+
+#ifdef MAP_HUGETLB
+    void *huge = mmap(NULL, *mapped, prot, flags | MAP_HUGETLB, -1, 0);
+    if (huge != MAP_FAILED) {
+        INFO("ram: %zu explicit huge pages", *mapped / HUGE_PAGE_SIZE);
+        return huge;
+    }
+#endif //MAP_HUGETLB
+
+    // over-allocate by a huge page and cut the mapping down to an aligned range
+    uint8_t *data = mmap(NULL, *mapped + HUGE_PAGE_SIZE, prot, flags, -1, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    size_t head = round_up((uintptr_t)data, HUGE_PAGE_SIZE) - (uintptr_t)data;
+    if (head != 0) {
+        munmap(data, head);
+    }
+    munmap(data + head + *mapped, HUGE_PAGE_SIZE - head);
+    data += head;
+
+#ifdef MADV_HUGEPAGE
+    // fails when transparent huge pages are disabled, the buffer still works with small pages
+    madvise(data, *mapped, MADV_HUGEPAGE);
+#endif //MADV_HUGEPAGE
+
+    return data;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t size)
+{
+    int result = 0;
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes = write(fd, data + done, size - done);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        CHECK_ERROR(bytes > 0, -1, "write() failed: %s", bytes < 0 ? strerror(errno) : "short write");
+        done += bytes;
+    }
+
+done:
+    return result;
+}
+
+// Reads until size bytes or the end of file, returns the byte count.
+static ssize_t read_all(int fd, uint8_t *data, size_t size)
+{
+    ssize_t result = 0;
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes = read(fd, data + done, size - done);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        CHECK_ERROR(bytes >= 0, -1, "read() failed: %s", strerror(errno));
+        if (bytes == 0) {
+            break;
+        }
+        done += bytes;
+    }
+
+    result = done;
+
+done:
+    return result;
+}
+
+// New regular files are replaced atomically through a temporary file, anything else is written in place.
+static int save(struct bd_context *context)
+{
+    int result = 0;
+
+    char *tmp = NULL;
+    int fd = -1;
+
+    struct stat stat_ = {0};
+    bool stream = context->fd >= 0;
+    bool in_place = context->mode == BD_MODE_UPDATE || (stat(context->image, &stat_) == 0 && !S_ISREG(stat_.st_mode));
+
+    if (stream) {
+        fd = context->fd;
+        context->fd = -1;
+    } else if (in_place) {
+        fd = open(context->image, O_WRONLY);
+        CHECK_ERROR(fd >= 0, -1, "open(%s) failed: %s", context->image, strerror(errno));
+    } else {
+        size_t tmp_size = strlen(context->image) + 32;
+        tmp = malloc(tmp_size);
+        CHECK_ERROR(tmp != NULL, -1, "malloc() failed");
+        snprintf(tmp, tmp_size, "%s.tmp.%ld", context->image, (long)getpid());
+
+        fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+        CHECK_ERROR(fd >= 0, -1, "open(%s) failed: %s", tmp, strerror(errno));
+    }
+
+    // pipes cannot seek
+    if (context->offset != 0) {
+        off_t position = lseek(fd, context->offset, SEEK_SET);
+        CHECK_ERROR(position >= 0, -1, "lseek() failed: %s", strerror(errno));
+    }
+
+    int err = write_all(fd, context->data, context->size);
+    CHECK_ERROR(err == 0, -1, "write_all() failed: %d", err);
+
+    if (context->level != BD_SYNC_FLUSH && !stream) {
+        err = sync_fd(fd, context->level == BD_SYNC_FULL);
+        CHECK_ERROR(err == 0, -1, "sync_fd() failed: %s", strerror(errno));
+    }
+
+    err = close(fd);
+    fd = -1;
+    CHECK_ERROR(err == 0, -1, "close() failed: %s", strerror(errno));
+
+    if (tmp != NULL) {
+        err = rename(tmp, context->image);
+        CHECK_ERROR(err == 0, -1, "rename(%s, %s) failed: %s", tmp, context->image, strerror(errno));
+        free(tmp);
+        tmp = NULL;
+    }
+
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (tmp != NULL) {
+        unlink(tmp);
+        free(tmp);
+    }
+    return result;
+}
+
+static int load(struct bd_context *context)
+{
+    int result = 0;
+
+    bool stream = context->fd >= 0;
+    int fd = stream ? context->fd : open(context->image, O_RDONLY);
+    CHECK_ERROR(fd >= 0, -1, "open(%s) failed: %s", context->image, strerror(errno));
+    context->fd = -1;
+
+    if (context->offset != 0) {
+        off_t position = lseek(fd, context->offset, SEEK_SET);
+        CHECK_ERROR(position >= 0, -1, "lseek() failed: %s", strerror(errno));
+    }
+
+    ssize_t bytes = read_all(fd, context->data, context->size);
+    CHECK_ERROR(bytes >= 0, -1, "read_all() failed: %zd", bytes);
+    CHECK_ERROR(stream || (size_t)bytes == context->size, -1, "short read: size: %zu, bytes: %zd", context->size, bytes);
+
+    // a trimmed image on a pipe ends early
+    if ((size_t)bytes < context->size) {
+        INFO("stream ended after %zd of %zu bytes, the rest reads as erased", bytes, context->size);
+        memset(context->data + bytes, 0xFF, context->size - bytes);
+    }
+
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+    return result;
+}
+
+static int bd_read(struct bd *bd, uint32_t block, uint32_t off, void *buffer, size_t size)
+{
+    struct bd_context *context = bd->opaque;
+    memcpy(buffer, context->data + bd->block_size * block + off, size);
+    return 0;
+}
+
+static int bd_prog(struct bd *bd, uint32_t block, uint32_t off, const void *buffer, size_t size)
+{
+    struct bd_context *context = bd->opaque;
+    memcpy(context->data + bd->block_size * block + off, buffer, size);
+    return 0;
+}
+
+static int bd_erase(struct bd *bd, uint32_t block)
+{
+    struct bd_context *context = bd->opaque;
+    memset(context->data + bd->block_size * block, 0xFF, bd->block_size);
+    return 0;
+}
+
+static int bd_fill(struct bd *bd)
+{
+    struct bd_context *context = bd->opaque;
+    memset(context->data, 0xFF, context->size);
+    return 0;
+}
+
+static int bd_sync(struct bd *bd, bd_sync_t level)
+{
+    struct bd_context *context = bd->opaque;
+
+    // nothing is on disk before close, remember how durable the final write has to be
+    context->level = level > context->level ? level : context->level;
+    return 0;
+}
+
+static int bd_discard(struct bd *bd)
+{
+    struct bd_context *context = bd->opaque;
+    context->discard = true;
+    return 0;
+}
+
+static int bd_close(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (context->mode != BD_MODE_READ && !context->discard && context->data != NULL) {
+        int err = save(context);
+        CHECK_ERROR(err == 0, -1, "save() failed: %d", err);
+    }
+
+done:
+    if (context->fd >= 0) {
+        close(context->fd);
+        context->fd = -1;
+    }
+    if (context->data != NULL) {
+        munmap(context->data, context->mapped);
+        context->data = NULL;
+    }
+    return result;
+}
+
+static struct bd m_bd_ram = {
+    .opaque = &m_context,
+    .read = bd_read,
+    .prog = bd_prog,
+    .erase = bd_erase,
+    .fill = bd_fill,
+    .sync = bd_sync,
+    .discard = bd_discard,
+    .close = bd_close
+};
+
+struct bd *bd_ram_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count,
+                      bd_ram_pages_t pages)
+{
+    struct bd *result = NULL;
+
+    CHECK_ERROR(image != NULL, NULL, "image == NULL");
+    CHECK_ERROR(block_count <= SIZE_MAX / block_size, NULL, "image does not fit in the address space");
+
+    m_context.image = image;
+    m_context.mode = mode;
+    m_context.offset = offset;
+    m_context.discard = false;
+    m_context.level = BD_SYNC_FLUSH;
+    m_context.size = block_size * block_count;
+
+    // before the allocation, whose messages would otherwise be flushed into a streamed image
+    if (is_stream(image)) {
+        m_context.fd = mode == BD_MODE_READ ? stream_stdin() : stream_stdout();
+        CHECK_ERROR(m_context.fd >= 0, NULL, "dup() failed: %s", strerror(errno));
+    }
+
+    m_context.data = buffer_alloc(m_context.size, pages, &m_context.mapped);
+    CHECK_ERROR(m_context.data != NULL, NULL, "mmap(%zu) failed: %s", m_context.size, strerror(errno));
+
+    if (mode == BD_MODE_READ) {
+        int err = load(&m_context);
+        CHECK_ERROR(err == 0, NULL, "load() failed: %d", err);
+    }
+
+    m_bd_ram.offset = offset;
+    m_bd_ram.block_size = block_size;
+    m_bd_ram.block_count = block_count;
+
+    result = &m_bd_ram;
+
+done:
+    if (result == NULL) {
+        m_context.discard = true;
+        bd_close(&m_bd_ram);
+    }
+    return result;
+}
+
+#else
+
+struct bd *bd_ram_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count,
+                      bd_ram_pages_t pages)
+{
+    ERROR("ram backend is not supported on this platform");
+    return NULL;
+}
+
+#endif //_WIN32
@@ -0,0 +1,27 @@
+// Copyright 2019 Sergey Tyultyaev
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "bd.h"
+
+typedef enum {
+    BD_RAM_PAGES_HUGE = 0, // explicit or transparent huge pages where available
+    BD_RAM_PAGES_NORMAL
+} bd_ram_pages_t;
+
+struct bd *bd_ram_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count,
+                      bd_ram_pages_t pages);
@@ -0,0 +1,550 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bd_sparse.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "util.h"
+
+#define SPARSE_MAGIC 0xED26FF3A
+#define SPARSE_MAJOR 1
+#define SPARSE_HEADER_SIZE 28
+#define CHUNK_HEADER_SIZE 12
+
+#define CHUNK_RAW 0xCAC1
+#define CHUNK_FILL 0xCAC2
+#define CHUNK_DONT_CARE 0xCAC3
+#define CHUNK_CRC32 0xCAC4
+
+#define NO_SLOT UINT32_MAX
+
+struct bd_context
+{
+    const char *image;
+    bool write;
+    bool stream;
+    bool discard;
+    bd_sync_t level;
+    FILE *file;
+    // a new image is built here and renamed over image once it is complete
+    char *tmp;
+    // programmed blocks are packed into an unlinked scratch file instead of memory, one slot per live block
+    FILE *scratch;
+    // slot of each block in scratch, blocks without one read as erased
+    uint32_t *slots;
+    // slots given back by erases, taken again before scratch grows
+    uint32_t *free_slots;
+    uint32_t free_count;
+    uint32_t slot_count;
+    uint8_t *buffer;
+    struct bd_sparse_stats stats;
+};
+
+static struct bd_context m_context = {0};
+
+static void put_le16(uint8_t *p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Reads past size bytes, the image may come from a pipe.
+static int skip(FILE *file, size_t size)
+{
+    uint8_t scratch[256];
+    while (size > 0) {
+        size_t chunk = size < sizeof(scratch) ? size : sizeof(scratch);
+        if (fread(scratch, 1, chunk, file) != chunk) {
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+static bool is_stored(const struct bd_context *context, uint32_t block)
+{
+    return context->slots[block] != NO_SLOT;
+}
+
+static int scratch_read(struct bd *bd, uint32_t block, uint32_t off, void *buffer, size_t size)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    off_t offset = (off_t)context->slots[block] * bd->block_size + off;
+    ssize_t bytes = pread(fileno(context->scratch), buffer, size, offset);
+    CHECK_ERROR(bytes == (ssize_t)size, -1, "pread() failed: %s", bytes < 0 ? strerror(errno) : "short read");
+
+done:
+    return result;
+}
+
+static int scratch_write(struct bd *bd, uint32_t block, uint32_t off, const void *buffer, size_t size)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (!is_stored(context, block)) {
+        context->slots[block] = context->free_count != 0 ? context->free_slots[--context->free_count]
+                                                         : context->slot_count++;
+    }
+
+    off_t offset = (off_t)context->slots[block] * bd->block_size + off;
+    ssize_t bytes = pwrite(fileno(context->scratch), buffer, size, offset);
+    CHECK_ERROR(bytes == (ssize_t)size, -1, "pwrite() failed: %s", bytes < 0 ? strerror(errno) : "short write");
+
+done:
+    return result;
+}
+
+static void scratch_release(struct bd_context *context, uint32_t block)
+{
+    if (is_stored(context, block)) {
+        context->free_slots[context->free_count++] = context->slots[block];
+        context->slots[block] = NO_SLOT;
+    }
+}
+
+// Next to the image when it is a new file, so that the scratch space comes from the same disk and not from /tmp.
+static FILE *scratch_open(const char *image, bool beside)
+{
+    if (!beside) {
+        return tmpfile();
+    }
+
+    size_t path_size = strlen(image) + 32;
+    char *path = malloc(path_size);
+    if (path == NULL) {
+        return NULL;
+    }
+    snprintf(path, path_size, "%s.scratch.%ld", image, (long)getpid());
+
+    FILE *file = NULL;
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd >= 0) {
+        unlink(path);
+        file = fdopen(fd, "w+b");
+        if (file == NULL) {
+            close(fd);
+        }
+    }
+    free(path);
+    return file;
+}
+
+// Returns the end of the run starting at start, raw runs are split so that the chunk size fits in 32 bits.
+static uint32_t next_run(struct bd *bd, uint32_t start)
+{
+    const struct bd_context *context = bd->opaque;
+    bool raw = is_stored(context, start);
+    uint32_t max = raw ? (UINT32_MAX - CHUNK_HEADER_SIZE) / bd->block_size : UINT32_MAX;
+
+    uint32_t end = start + 1;
+    while (end < bd->block_count && end - start < max && is_stored(context, end) == raw) {
+        end++;
+    }
+    return end;
+}
+
+static int save(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    uint32_t raw = 0;
+    uint32_t fill = 0;
+
+    // the header carries the chunk count, so runs are counted before anything is written
+    uint32_t chunks = 0;
+    for (uint32_t block = 0; block < bd->block_count; block = next_run(bd, block)) {
+        chunks++;
+    }
+
+    uint8_t header[SPARSE_HEADER_SIZE] = {0};
+    put_le32(header, SPARSE_MAGIC);
+    put_le16(header + 4, SPARSE_MAJOR);
+    put_le16(header + 6, 0);
+    put_le16(header + 8, SPARSE_HEADER_SIZE);
+    put_le16(header + 10, CHUNK_HEADER_SIZE);
+    put_le32(header + 12, bd->block_size);
+    put_le32(header + 16, bd->block_count);
+    put_le32(header + 20, chunks);
+    put_le32(header + 24, 0);
+
+    size_t bytes = fwrite(header, 1, sizeof(header), context->file);
+    CHECK_ERROR(bytes == sizeof(header), -1, "fwrite() failed: %s", strerror(errno));
+
+    for (uint32_t block = 0; block < bd->block_count;) {
+        uint32_t end = next_run(bd, block);
+        bool erased_run = !is_stored(context, block);
+
+        uint8_t chunk[CHUNK_HEADER_SIZE + 4];
+        put_le16(chunk, erased_run ? CHUNK_FILL : CHUNK_RAW);
+        put_le16(chunk + 2, 0);
+        put_le32(chunk + 4, end - block);
+        put_le32(chunk + 8, CHUNK_HEADER_SIZE + (erased_run ? 4 : (end - block) * (uint32_t)bd->block_size));
+        put_le32(chunk + 12, 0xFFFFFFFF);
+
+        size_t size = erased_run ? sizeof(chunk) : CHUNK_HEADER_SIZE;
+        bytes = fwrite(chunk, 1, size, context->file);
+        CHECK_ERROR(bytes == size, -1, "fwrite() failed: %s", strerror(errno));
+
+        for (; !erased_run && block < end; block++) {
+            int err = scratch_read(bd, block, 0, context->buffer, bd->block_size);
+            CHECK_ERROR(err == 0, -1, "scratch_read() failed: %d", err);
+            bytes = fwrite(context->buffer, 1, bd->block_size, context->file);
+            CHECK_ERROR(bytes == bd->block_size, -1, "fwrite() failed: %s", strerror(errno));
+        }
+
+        if (erased_run) {
+            fill++;
+        } else {
+            raw++;
+        }
+        block = end;
+    }
+
+    int err = fflush(context->file);
+    CHECK_ERROR(err == 0, -1, "fflush() failed: %s", strerror(errno));
+
+    if (context->level != BD_SYNC_FLUSH && !context->stream) {
+        err = sync_fd(fileno(context->file), context->level == BD_SYNC_FULL);
+        CHECK_ERROR(err == 0, -1, "sync_fd() failed: %s", strerror(errno));
+    }
+
+    err = fclose(context->file);
+    context->file = NULL;
+    CHECK_ERROR(err == 0, -1, "fclose() failed: %s", strerror(errno));
+
+    if (context->tmp != NULL) {
+        err = rename(context->tmp, context->image);
+        CHECK_ERROR(err == 0, -1, "rename(%s, %s) failed: %s", context->tmp, context->image, strerror(errno));
+        free(context->tmp);
+        context->tmp = NULL;
+    }
+
+    context->stats.raw = raw;
+    context->stats.fill = fill;
+
+done:
+    return result;
+}
+
+static int load(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    uint8_t header[SPARSE_HEADER_SIZE];
+    size_t bytes = fread(header, 1, sizeof(header), context->file);
+    CHECK_ERROR(bytes == sizeof(header), -1, "fread() failed: image is too small");
+    CHECK_ERROR(get_le32(header) == SPARSE_MAGIC, -1, "not a sparse image");
+    CHECK_ERROR(get_le16(header + 4) == SPARSE_MAJOR, -1, "unsupported sparse version: %u", get_le16(header + 4));
+
+    size_t header_size = get_le16(header + 8);
+    size_t chunk_header_size = get_le16(header + 10);
+    uint32_t block_size = get_le32(header + 12);
+    uint32_t block_count = get_le32(header + 16);
+    uint32_t chunks = get_le32(header + 20);
+
+    CHECK_ERROR(header_size >= SPARSE_HEADER_SIZE && chunk_header_size >= CHUNK_HEADER_SIZE, -1,
+                "bad header sizes: %zu, %zu", header_size, chunk_header_size);
+    CHECK_ERROR(block_size == bd->block_size, -1, "block size mismatch: %u != %zu", block_size, bd->block_size);
+    CHECK_ERROR(block_count == bd->block_count, -1, "block count mismatch: %u != %zu", block_count, bd->block_count);
+
+    int err = skip(context->file, header_size - SPARSE_HEADER_SIZE);
+    CHECK_ERROR(err == 0, -1, "skip() failed: truncated header");
+
+    uint32_t block = 0;
+    for (uint32_t i = 0; i < chunks; i++) {
+        uint8_t chunk[CHUNK_HEADER_SIZE];
+        bytes = fread(chunk, 1, sizeof(chunk), context->file);
+        CHECK_ERROR(bytes == sizeof(chunk), -1, "fread() failed: truncated chunk %u", i);
+
+        err = skip(context->file, chunk_header_size - CHUNK_HEADER_SIZE);
+        CHECK_ERROR(err == 0, -1, "skip() failed: truncated chunk %u", i);
+
+        uint16_t type = get_le16(chunk);
+        uint32_t count = get_le32(chunk + 4);
+        CHECK_ERROR(count <= block_count - block, -1, "chunk %u runs past the end of the image", i);
+
+        switch (type) {
+            case CHUNK_RAW: {
+                for (uint32_t end = block + count; block < end; block++) {
+                    bytes = fread(context->buffer, 1, bd->block_size, context->file);
+                    CHECK_ERROR(bytes == bd->block_size, -1, "fread() failed: truncated chunk %u", i);
+                    err = scratch_write(bd, block, 0, context->buffer, bd->block_size);
+                    CHECK_ERROR(err == 0, -1, "scratch_write() failed: %d", err);
+                }
+            } break;
+            case CHUNK_FILL: {
+                uint8_t pattern[4];
+                bytes = fread(pattern, 1, sizeof(pattern), context->file);
+                CHECK_ERROR(bytes == sizeof(pattern), -1, "fread() failed: truncated chunk %u", i);
+
+                if (get_le32(pattern) == 0xFFFFFFFF) {
+                    block += count;
+                    break;
+                }
+
+                for (size_t off = 0; off < bd->block_size; off += sizeof(pattern)) {
+                    memcpy(context->buffer + off, pattern, sizeof(pattern));
+                }
+                for (uint32_t end = block + count; block < end; block++) {
+                    err = scratch_write(bd, block, 0, context->buffer, bd->block_size);
+                    CHECK_ERROR(err == 0, -1, "scratch_write() failed: %d", err);
+                }
+            } break;
+            case CHUNK_DONT_CARE: {
+                block += count;
+            } break;
+            case CHUNK_CRC32: {
+                err = skip(context->file, 4);
+                CHECK_ERROR(err == 0, -1, "skip() failed: truncated chunk %u", i);
+            } break;
+            default:
+                CHECK_ERROR(false, -1, "unknown chunk type: 0x%04x", type);
+        }
+    }
+
+done:
+    return result;
+}
+
+static int bd_read(struct bd *bd, uint32_t block, uint32_t off, void *buffer, size_t size)
+{
+    struct bd_context *context = bd->opaque;
+
+    if (!is_stored(context, block)) {
+        memset(buffer, 0xFF, size);
+        return 0;
+    }
+    return scratch_read(bd, block, off, buffer, size);
+}
+
+static int bd_prog(struct bd *bd, uint32_t block, uint32_t off, const void *buffer, size_t size)
+{
+    struct bd_context *context = bd->opaque;
+
+    // the first program writes the whole block, so that the rest of it reads as erased and not as a hole
+    if (!is_stored(context, block)) {
+        memset(context->buffer, 0xFF, bd->block_size);
+        memcpy(context->buffer + off, buffer, size);
+        return scratch_write(bd, block, 0, context->buffer, bd->block_size);
+    }
+    return scratch_write(bd, block, off, buffer, size);
+}
+
+static int bd_erase(struct bd *bd, uint32_t block)
+{
+    struct bd_context *context = bd->opaque;
+    scratch_release(context, block);
+    return 0;
+}
+
+static int bd_fill(struct bd *bd)
+{
+    struct bd_context *context = bd->opaque;
+
+    // nothing in scratch is live any more, it starts over from the first slot
+    memset(context->slots, 0xFF, bd->block_count * sizeof(*context->slots));
+    context->free_count = 0;
+    context->slot_count = 0;
+    if (ftruncate(fileno(context->scratch), 0) != 0) {
+        ERROR("ftruncate() failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int bd_sync(struct bd *bd, bd_sync_t level)
+{
+    struct bd_context *context = bd->opaque;
+
+    // nothing is on disk before close, remember how durable the final write has to be
+    context->level = level > context->level ? level : context->level;
+    return 0;
+}
+
+static int bd_discard(struct bd *bd)
+{
+    struct bd_context *context = bd->opaque;
+    context->discard = true;
+    return 0;
+}
+
+static int bd_close(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (context->write && !context->discard && context->file != NULL && context->slots != NULL) {
+        int err = save(bd);
+        CHECK_ERROR(err == 0, -1, "save() failed: %d", err);
+    }
+
+done:
+    if (context->file != NULL) {
+        int err = fclose(context->file);
+        if (err != 0) {
+            ERROR("fclose() failed: %s", strerror(errno));
+            result = -1;
+        }
+        context->file = NULL;
+    }
+    // a failed or discarded build leaves the existing image alone
+    if (context->tmp != NULL) {
+        unlink(context->tmp);
+        free(context->tmp);
+        context->tmp = NULL;
+    }
+    if (context->scratch != NULL) {
+        fclose(context->scratch);
+        context->scratch = NULL;
+    }
+    free(context->slots);
+    context->slots = NULL;
+    free(context->free_slots);
+    context->free_slots = NULL;
+    free(context->buffer);
+    context->buffer = NULL;
+    return result;
+}
+
+static struct bd m_bd_sparse = {
+    .opaque = &m_context,
+    .read = bd_read,
+    .prog = bd_prog,
+    .erase = bd_erase,
+    .fill = bd_fill,
+    .sync = bd_sync,
+    .discard = bd_discard,
+    .close = bd_close
+};
+
+void bd_sparse_get_stats(const struct bd *bd, struct bd_sparse_stats *stats)
+{
+    const struct bd_context *context = bd->opaque;
+    *stats = context->stats;
+}
+
+struct bd *bd_sparse_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count)
+{
+    struct bd *result = NULL;
+
+    CHECK_ERROR(image != NULL, NULL, "image == NULL");
+    CHECK_ERROR(mode != BD_MODE_UPDATE && offset == 0, NULL, "sparse images cannot be written into another file");
+    CHECK_ERROR((block_size & 3) == 0, NULL, "block size is not a multiple of 4: %zu", block_size);
+    CHECK_ERROR(block_count <= UINT32_MAX, NULL, "too many blocks: %zu", block_count);
+
+    m_context.image = image;
+    m_context.write = mode == BD_MODE_CREATE;
+    m_context.discard = false;
+    m_context.level = BD_SYNC_FLUSH;
+    memset(&m_context.stats, 0, sizeof(m_context.stats));
+
+    m_bd_sparse.block_size = block_size;
+    m_bd_sparse.block_count = block_count;
+
+    m_context.slots = malloc(block_count * sizeof(*m_context.slots));
+    CHECK_ERROR(m_context.slots != NULL, NULL, "malloc() failed");
+    memset(m_context.slots, 0xFF, block_count * sizeof(*m_context.slots));
+    m_context.free_slots = malloc(block_count * sizeof(*m_context.free_slots));
+    CHECK_ERROR(m_context.free_slots != NULL, NULL, "malloc() failed");
+    m_context.free_count = 0;
+    m_context.slot_count = 0;
+    m_context.buffer = malloc(block_size);
+    CHECK_ERROR(m_context.buffer != NULL, NULL, "malloc() failed");
+
+    m_context.stream = is_stream(image);
+    if (m_context.stream) {
+        int fd = m_context.write ? stream_stdout() : stream_stdin();
+        CHECK_ERROR(fd >= 0, NULL, "dup() failed: %s", strerror(errno));
+        m_context.file = fdopen(fd, m_context.write ? "wb" : "rb");
+        if (m_context.file == NULL) {
+            close(fd);
+        }
+    } else if (m_context.write) {
+        size_t tmp_size = strlen(image) + 32;
+        char *tmp = malloc(tmp_size);
+        CHECK_ERROR(tmp != NULL, NULL, "malloc() failed");
+        snprintf(tmp, tmp_size, "%s.tmp.%ld", image, (long)getpid());
+
+        // only a file created here is removed again on failure
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+        if (fd < 0) {
+            ERROR("open(%s) failed: %s", tmp, strerror(errno));
+            free(tmp);
+            goto done;
+        }
+        m_context.tmp = tmp;
+        m_context.file = fdopen(fd, "wb");
+        if (m_context.file == NULL) {
+            close(fd);
+        }
+    } else {
+        m_context.file = fopen(image, "rb");
+    }
+    CHECK_ERROR(m_context.file != NULL, NULL, "fopen(%s) failed: %s", image, strerror(errno));
+
+    m_context.scratch = scratch_open(image, m_context.write && !m_context.stream);
+    CHECK_ERROR(m_context.scratch != NULL, NULL, "scratch_open() failed: %s", strerror(errno));
+
+    if (m_context.write) {
+        setvbuf(m_context.file, NULL, _IOFBF, 1 << 20);
+    } else {
+        int err = load(&m_bd_sparse);
+        CHECK_ERROR(err == 0, NULL, "load() failed: %d", err);
+    }
+
+    result = &m_bd_sparse;
+
+done:
+    if (result == NULL) {
+        m_context.discard = true;
+        bd_close(&m_bd_sparse);
+    }
+    return result;
+}
@@ -0,0 +1,33 @@
+// Copyright 2019 Sergey Tyultyaev
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "bd.h"
+
+// Android sparse image, erased runs become FILL chunks. Programmed blocks are kept in a scratch file and a new image
+// is written to a temporary file that replaces the target only once it is complete.
+struct bd *bd_sparse_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count);
+
+struct bd_sparse_stats
+{
+    uint32_t raw;
+    uint32_t fill;
+};
+
+// Chunks written out when a new image is closed, kept until the next bd_sparse_get().
+void bd_sparse_get_stats(const struct bd *bd, struct bd_sparse_stats *stats);
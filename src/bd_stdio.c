@@ -0,0 +1,197 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bd_stdio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "macro.h"
+#include "util.h"
+
+struct bd_context
+{
+    FILE *file;
+    // one block of 0xFF for erases
+    uint8_t *erased;
+};
+
+static struct bd_context m_context = {0};
+
+static int bd_read(struct bd *bd, uint32_t block, uint32_t off, void *buffer, size_t size)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    int err = fseeko(context->file, bd_position(bd, block, off), SEEK_SET);
+    CHECK_ERROR(err == 0, -1, "fseeko() failed: %d", err);
+
+    size_t bytes = fread(buffer, 1, size, context->file);
+    CHECK_ERROR(bytes == size, -1, "fread() failed: off: %u, size: %zu, bytes: %zu", off, size, bytes);
+
+done:
+    return result;
+}
+
+static int bd_prog(struct bd *bd, uint32_t block, uint32_t off, const void *buffer, size_t size)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    int err = fseeko(context->file, bd_position(bd, block, off), SEEK_SET);
+    CHECK_ERROR(err == 0, -1, "fseeko() failed: %d", err);
+
+    size_t bytes = fwrite(buffer, 1, size, context->file);
+    CHECK_ERROR(bytes == size, -1, "fwrite() failed");
+
+done:
+    return result;
+}
+
+static int bd_erase(struct bd *bd, uint32_t block)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    int err = fseeko(context->file, bd_position(bd, block, 0), SEEK_SET);
+    CHECK_ERROR(err == 0, -1, "fseeko() failed: %d", err);
+
+    size_t bytes = fwrite(context->erased, 1, bd->block_size, context->file);
+    CHECK_ERROR(bytes == bd->block_size, -1, "fwrite() failed");
+
+done:
+    return result;
+}
+
+static int bd_fill(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    uint8_t erased[65536];
+    memset(erased, 0xFF, sizeof(erased));
+
+    int err = fseeko(context->file, bd_position(bd, 0, 0), SEEK_SET);
+    CHECK_ERROR(err == 0, -1, "fseeko() failed: %d", err);
+
+    uint64_t size = (uint64_t)bd->block_size * bd->block_count;
+    for (uint64_t off = 0; off < size; off += sizeof(erased)) {
+        size_t chunk = size - off < sizeof(erased) ? size - off : sizeof(erased);
+        size_t bytes = fwrite(erased, 1, chunk, context->file);
+        CHECK_ERROR(bytes == chunk, -1, "fwrite() failed");
+    }
+
+done:
+    return result;
+}
+
+static int bd_advise(struct bd *bd, uint32_t block, uint32_t count)
+{
+#ifndef _WIN32
+    struct bd_context *context = bd->opaque;
+    return posix_fadvise(fileno(context->file), bd_position(bd, block, 0), (off_t)bd->block_size * count,
+                         POSIX_FADV_WILLNEED) == 0
+               ? 0
+               : -1;
+#else
+    return 0;
+#endif //_WIN32
+}
+
+static int bd_sync(struct bd *bd, bd_sync_t level)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    int err = fflush(context->file);
+    CHECK_ERROR(err != EOF, -1, "fflush() failed: %s", strerror(errno));
+
+    if (level != BD_SYNC_FLUSH) {
+        err = sync_fd(fileno(context->file), level == BD_SYNC_FULL);
+        CHECK_ERROR(err == 0, -1, "sync_fd() failed: %s", strerror(errno));
+    }
+
+done:
+    return result;
+}
+
+static int bd_close(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    free(context->erased);
+    context->erased = NULL;
+
+    int err = fclose(context->file);
+    context->file = NULL;
+    CHECK_ERROR(err == 0, -1, "fclose() failed: %s", strerror(errno));
+
+done:
+    return result;
+}
+
+static struct bd m_bd_stdio = {
+    .opaque = &m_context,
+    .read = bd_read,
+    .prog = bd_prog,
+    .erase = bd_erase,
+    .fill = bd_fill,
+    .advise = bd_advise,
+    .sync = bd_sync,
+    .close = bd_close
+};
+
+struct bd *bd_stdio_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count)
+{
+    struct bd *result = NULL;
+
+    CHECK_ERROR(image != NULL, NULL, "image == NULL");
+
+    const char *modes[] = {[BD_MODE_READ] = "rb", [BD_MODE_CREATE] = "w+b", [BD_MODE_UPDATE] = "r+b"};
+    m_context.file = fopen(image, modes[mode]);
+    CHECK_ERROR(m_context.file != NULL, NULL, "fopen() failed: %s", strerror(errno));
+
+    m_context.erased = malloc(block_size);
+    CHECK_ERROR(m_context.erased != NULL, NULL, "malloc() failed");
+    memset(m_context.erased, 0xFF, block_size);
+
+    if (mode == BD_MODE_CREATE) {
+        int err = ftruncate(fileno(m_context.file), offset + (off_t)block_size * block_count);
+        CHECK_ERROR(err == 0, NULL, "ftruncate() failed: %s", strerror(errno));
+    }
+
+    m_bd_stdio.offset = offset;
+    m_bd_stdio.block_size = block_size;
+    m_bd_stdio.block_count = block_count;
+
+    result = &m_bd_stdio;
+
+done:
+    if (result == NULL && m_context.file != NULL) {
+        fclose(m_context.file);
+        m_context.file = NULL;
+    }
+    if (result == NULL) {
+        free(m_context.erased);
+        m_context.erased = NULL;
+    }
+    return result;
+}
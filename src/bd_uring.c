@@ -0,0 +1,580 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// syscall() and MAP_POPULATE
+#define _GNU_SOURCE
+
+#include "bd_uring.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "util.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define QUEUE_DEPTH 64
+#define SUBMIT_BATCH 16
+
+typedef enum {
+    SLOT_FREE = 0,
+    SLOT_QUEUED,
+    SLOT_INFLIGHT
+} slot_state_t;
+
+// A pending write. The buffer mirrors the whole block, valid data is [lo, hi).
+struct slot
+{
+    slot_state_t state;
+    uint32_t block;
+    uint32_t lo;
+    uint32_t hi;
+    uint8_t *buffer;
+    struct iovec iov;
+};
+
+struct ring
+{
+    int fd;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+struct bd_context
+{
+    int fd;
+    uint64_t offset;
+    size_t block_size;
+    struct ring ring;
+    struct slot slots[QUEUE_DEPTH];
+    uint8_t *buffers;
+    uint8_t *erased;
+    // slots waiting for submission, in program order
+    unsigned queue[QUEUE_DEPTH];
+    unsigned queued;
+    unsigned inflight;
+    int error;
+};
+
+static struct bd_context m_context = {.fd = -1, .ring = {.fd = -1}};
+
+static int ring_enter(struct ring *ring, unsigned to_submit, unsigned min_complete)
+{
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    long ret = 0;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return (int)ret;
+}
+
+static void ring_teardown(struct ring *ring)
+{
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    ring->cq_ptr = NULL;
+    if (ring->sq_ptr != NULL) {
+        munmap(ring->sq_ptr, ring->sq_size);
+        ring->sq_ptr = NULL;
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+static int ring_setup(struct ring *ring, unsigned entries)
+{
+    int result = 0;
+
+    struct io_uring_params params = {0};
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    CHECK_ERROR(ring->fd >= 0, -1, "io_uring_setup() failed: %s", strerror(errno));
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_size = ring->cq_size > ring->sq_size ? ring->cq_size : ring->sq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    void *ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                     IORING_OFF_SQ_RING);
+    CHECK_ERROR(ptr != MAP_FAILED, -1, "mmap(sq) failed: %s", strerror(errno));
+    ring->sq_ptr = ptr;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                   IORING_OFF_CQ_RING);
+        CHECK_ERROR(ptr != MAP_FAILED, -1, "mmap(cq) failed: %s", strerror(errno));
+        ring->cq_ptr = ptr;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    CHECK_ERROR(ptr != MAP_FAILED, -1, "mmap(sqes) failed: %s", strerror(errno));
+    ring->sqes = ptr;
+
+    uint8_t *sq = ring->sq_ptr;
+    uint8_t *cq = ring->cq_ptr;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+done:
+    if (result != 0) {
+        ring_teardown(ring);
+    }
+    return result;
+}
+
+static int submit(struct bd_context *context)
+{
+    int result = 0;
+    struct ring *ring = &context->ring;
+
+    if (context->queued == 0) {
+        goto done;
+    }
+
+    unsigned tail = *ring->sq_tail;
+    for (unsigned i = 0; i < context->queued; i++) {
+        unsigned index = context->queue[i];
+        struct slot *slot = &context->slots[index];
+
+        slot->iov.iov_base = slot->buffer + slot->lo;
+        slot->iov.iov_len = slot->hi - slot->lo;
+
+        unsigned sq_index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[sq_index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = context->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&slot->iov;
+        sqe->len = 1;
+        sqe->off = context->offset + (uint64_t)context->block_size * slot->block + slot->lo;
+        sqe->user_data = index;
+        ring->sq_array[sq_index] = sq_index;
+
+        slot->state = SLOT_INFLIGHT;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned count = context->queued;
+    unsigned pending = count;
+    context->inflight += count;
+    context->queued = 0;
+
+    while (pending > 0) {
+        int ret = ring_enter(ring, pending, 0);
+        if (ret <= 0) {
+            ERROR("io_uring_enter() failed: %s", ret < 0 ? strerror(errno) : "no entries taken");
+            // the kernel takes entries in order, the ones left over never complete and must not be waited for
+            for (unsigned i = count - pending; i < count; i++) {
+                context->slots[context->queue[i]].state = SLOT_FREE;
+            }
+            context->inflight -= pending;
+            context->error = -1;
+            result = -1;
+            goto done;
+        }
+        pending -= ret;
+    }
+
+done:
+    return result;
+}
+
+static int reap(struct bd_context *context, bool wait)
+{
+    int result = 0;
+    struct ring *ring = &context->ring;
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail && wait) {
+        int ret = ring_enter(ring, 0, 1);
+        CHECK_ERROR(ret >= 0, -1, "io_uring_enter() failed: %s", strerror(errno));
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct slot *slot = &context->slots[cqe->user_data];
+
+        if (cqe->res < 0) {
+            ERROR("write failed: block: %u, off: %u: %s", slot->block, slot->lo, strerror(-cqe->res));
+            context->error = -1;
+        } else if ((uint32_t)cqe->res != slot->hi - slot->lo) {
+            ERROR("short write: block: %u, off: %u, size: %u, bytes: %d", slot->block, slot->lo,
+                  slot->hi - slot->lo, cqe->res);
+            context->error = -1;
+        }
+
+        slot->state = SLOT_FREE;
+        context->inflight--;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+done:
+    return result;
+}
+
+static int drain(struct bd_context *context)
+{
+    int result = 0;
+
+    int err = submit(context);
+    CHECK_ERROR(err == 0, -1, "submit() failed: %d", err);
+
+    while (context->inflight > 0) {
+        err = reap(context, true);
+        CHECK_ERROR(err == 0, -1, "reap() failed: %d", err);
+    }
+
+    CHECK_ERROR(context->error == 0, -1, "queued writes failed");
+
+done:
+    return result;
+}
+
+static bool is_pending(const struct bd_context *context, uint32_t block)
+{
+    for (unsigned i = 0; i < QUEUE_DEPTH; i++) {
+        if (context->slots[i].state != SLOT_FREE && context->slots[i].block == block) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static struct slot *slot_get(struct bd_context *context)
+{
+    struct slot *result = NULL;
+
+    while (result == NULL) {
+        for (unsigned i = 0; i < QUEUE_DEPTH; i++) {
+            if (context->slots[i].state == SLOT_FREE) {
+                context->queue[context->queued++] = i;
+                result = &context->slots[i];
+                result->state = SLOT_QUEUED;
+                goto done;
+            }
+        }
+
+        int err = submit(context);
+        CHECK_ERROR(err == 0, NULL, "submit() failed: %d", err);
+
+        err = reap(context, true);
+        CHECK_ERROR(err == 0, NULL, "reap() failed: %d", err);
+    }
+
+done:
+    return result;
+}
+
+// Queues a write, merging it into a queued write of the same block when the ranges touch.
+static int queue_write(struct bd_context *context, uint32_t block, uint32_t off, const void *buffer, uint32_t size)
+{
+    int result = 0;
+
+    struct slot *merge = NULL;
+    bool conflict = false;
+
+    for (unsigned i = 0; i < QUEUE_DEPTH; i++) {
+        struct slot *slot = &context->slots[i];
+        if (slot->state == SLOT_FREE || slot->block != block) {
+            continue;
+        }
+
+        bool overlaps = off < slot->hi && slot->lo < off + size;
+        bool touches = off <= slot->hi && slot->lo <= off + size;
+
+        if (slot->state == SLOT_QUEUED && touches && merge == NULL) {
+            merge = slot;
+        } else if (overlaps) {
+            // completion order is not defined, overlapping writes must not be in the ring together
+            conflict = true;
+        }
+    }
+
+    if (conflict) {
+        int err = drain(context);
+        CHECK_ERROR(err == 0, -1, "drain() failed: %d", err);
+        merge = NULL;
+    }
+
+    if (merge != NULL) {
+        memcpy(merge->buffer + off, buffer, size);
+        merge->lo = off < merge->lo ? off : merge->lo;
+        merge->hi = off + size > merge->hi ? off + size : merge->hi;
+        goto done;
+    }
+
+    struct slot *slot = slot_get(context);
+    CHECK_ERROR(slot != NULL, -1, "slot_get() failed");
+
+    slot->block = block;
+    slot->lo = off;
+    slot->hi = off + size;
+    memcpy(slot->buffer + off, buffer, size);
+
+    if (context->queued >= SUBMIT_BATCH) {
+        int err = submit(context);
+        CHECK_ERROR(err == 0, -1, "submit() failed: %d", err);
+    }
+
+done:
+    return result;
+}
+
+static int bd_read(struct bd *bd, uint32_t block, uint32_t off, void *buffer, size_t size)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (is_pending(context, block)) {
+        int err = drain(context);
+        CHECK_ERROR(err == 0, -1, "drain() failed: %d", err);
+    }
+
+    off_t offset = bd_position(bd, block, off);
+    uint8_t *data = buffer;
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t bytes = pread(context->fd, data + done, size - done, offset + done);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        CHECK_ERROR(bytes >= 0, -1, "pread() failed: block: %u, off: %u: %s", block, off, strerror(errno));
+        CHECK_ERROR(bytes > 0, -1, "short read: block: %u, off: %u, size: %zu, bytes: %zu", block, off, size, done);
+        done += bytes;
+    }
+
+done:
+    return result;
+}
+
+static int bd_prog(struct bd *bd, uint32_t block, uint32_t off, const void *buffer, size_t size)
+{
+    struct bd_context *context = bd->opaque;
+
+    if (context->error != 0) {
+        return context->error;
+    }
+
+    return queue_write(context, block, off, buffer, size);
+}
+
+static int bd_erase(struct bd *bd, uint32_t block)
+{
+    struct bd_context *context = bd->opaque;
+
+    if (context->error != 0) {
+        return context->error;
+    }
+
+    return queue_write(context, block, 0, context->erased, bd->block_size);
+}
+
+static int bd_fill(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    int err = drain(context);
+    CHECK_ERROR(err == 0, -1, "drain() failed: %d", err);
+
+    for (uint32_t block = 0; block < bd->block_count; block++) {
+        err = bd_erase(bd, block);
+        CHECK_ERROR(err == 0, -1, "bd_erase() failed: %d", err);
+    }
+
+    err = drain(context);
+    CHECK_ERROR(err == 0, -1, "drain() failed: %d", err);
+
+done:
+    return result;
+}
+
+static int bd_advise(struct bd *bd, uint32_t block, uint32_t count)
+{
+    struct bd_context *context = bd->opaque;
+    return posix_fadvise(context->fd, bd_position(bd, block, 0), (off_t)bd->block_size * count, POSIX_FADV_WILLNEED) == 0
+               ? 0
+               : -1;
+}
+
+static int bd_sync(struct bd *bd, bd_sync_t level)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    int err = drain(context);
+    CHECK_ERROR(err == 0, -1, "drain() failed: %d", err);
+
+    if (level != BD_SYNC_FLUSH) {
+        err = sync_fd(context->fd, level == BD_SYNC_FULL);
+        CHECK_ERROR(err == 0, -1, "sync_fd() failed: %s", strerror(errno));
+    }
+
+done:
+    return result;
+}
+
+static int bd_close(struct bd *bd)
+{
+    int result = 0;
+    struct bd_context *context = bd->opaque;
+
+    if (context->ring.fd >= 0) {
+        int err = drain(context);
+        if (err != 0) {
+            ERROR("drain() failed: %d", err);
+            result = -1;
+        }
+        ring_teardown(&context->ring);
+    }
+
+    free(context->buffers);
+    context->buffers = NULL;
+    free(context->erased);
+    context->erased = NULL;
+
+    if (context->fd >= 0) {
+        int err = close(context->fd);
+        if (err != 0) {
+            ERROR("close() failed: %s", strerror(errno));
+            result = -1;
+        }
+        context->fd = -1;
+    }
+
+    return result;
+}
+
+static struct bd m_bd_uring = {
+    .opaque = &m_context,
+    .read = bd_read,
+    .prog = bd_prog,
+    .erase = bd_erase,
+    .fill = bd_fill,
+    .advise = bd_advise,
+    .sync = bd_sync,
+    .close = bd_close
+};
+
+struct bd *bd_uring_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count)
+{
+    struct bd *result = NULL;
+
+    CHECK_ERROR(image != NULL, NULL, "image == NULL");
+
+    memset(m_context.slots, 0, sizeof(m_context.slots));
+    m_context.queued = 0;
+    m_context.inflight = 0;
+    m_context.error = 0;
+    m_context.offset = offset;
+    m_context.block_size = block_size;
+
+    int err = ring_setup(&m_context.ring, QUEUE_DEPTH);
+    CHECK_ERROR(err == 0, NULL, "ring_setup() failed: %d", err);
+
+    m_context.buffers = malloc(QUEUE_DEPTH * block_size);
+    CHECK_ERROR(m_context.buffers != NULL, NULL, "malloc() failed");
+    for (unsigned i = 0; i < QUEUE_DEPTH; i++) {
+        m_context.slots[i].buffer = m_context.buffers + i * block_size;
+    }
+
+    m_context.erased = malloc(block_size);
+    CHECK_ERROR(m_context.erased != NULL, NULL, "malloc() failed");
+    memset(m_context.erased, 0xFF, block_size);
+
+    m_context.fd = open(image, bd_open_flags(mode), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    CHECK_ERROR(m_context.fd >= 0, NULL, "open() failed: %s", strerror(errno));
+
+    if (mode == BD_MODE_CREATE) {
+        err = ftruncate(m_context.fd, offset + (off_t)block_size * block_count);
+        CHECK_ERROR(err == 0, NULL, "ftruncate() failed: %s", strerror(errno));
+    }
+
+    m_bd_uring.offset = offset;
+    m_bd_uring.block_size = block_size;
+    m_bd_uring.block_count = block_count;
+
+    result = &m_bd_uring;
+
+done:
+    if (result == NULL) {
+        bd_close(&m_bd_uring);
+    }
+    return result;
+}
+
+#else
+
+struct bd *bd_uring_get(const char *image, bd_mode_t mode, uint64_t offset, size_t block_size, size_t block_count)
+{
+    ERROR("io_uring backend is not supported on this platform");
+    return NULL;
+}
+
+#endif //HAVE_IO_URING
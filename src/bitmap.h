@@ -0,0 +1,45 @@
+// Copyright 2019 Sergey Tyultyaev
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline uint32_t *bitmap_alloc(size_t bits, bool value)
+{
+    size_t size = (bits + 31) / 32 * sizeof(uint32_t);
+    uint32_t *bitmap = malloc(size);
+    if (bitmap != NULL) {
+        memset(bitmap, value ? 0xFF : 0x00, size);
+    }
+    return bitmap;
+}
+
+static inline bool bitmap_test(const uint32_t *bitmap, size_t bit)
+{
+    return bitmap[bit / 32] & (1U << (bit % 32));
+}
+
+static inline void bitmap_set(uint32_t *bitmap, size_t bit)
+{
+    bitmap[bit / 32] |= 1U << (bit % 32);
+}
+
+static inline void bitmap_clear(uint32_t *bitmap, size_t bit)
+{
+    bitmap[bit / 32] &= ~(1U << (bit % 32));
+}
@@ -442,28 +442,48 @@ static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
     return 0;
 }
 
+// Find the first free block at or after off in the lookahead window,
+// skipping over words of used blocks
+static lfs_block_t lfs_alloc_scan(lfs_t *lfs, lfs_block_t off) {
+    while (off < lfs->free.size) {
+        uint32_t mask = ~lfs->free.buffer[off / 32] >> (off % 32);
+        if (mask) {
+            // bits past the window are clear, don't hand them out
+            return lfs_min(off + lfs_ctz(mask), lfs->free.size);
+        }
+
+        off += 32 - off % 32;
+    }
+
+    return lfs->free.size;
+}
+
+// Hand out the block at off in the lookahead window, it stays marked as
+// in use so blocks can be taken ahead of the cursor
+static lfs_block_t lfs_alloc_take(lfs_t *lfs, lfs_block_t off) {
+    lfs->free.buffer[off / 32] |= 1U << (off % 32);
+
+    if (off == lfs->free.i) {
+        // eagerly find next off so an alloc ack can
+        // discredit old lookahead blocks
+        lfs_block_t next = lfs_alloc_scan(lfs, off + 1);
+        lfs->free.ack -= next - lfs->free.i;
+        lfs->free.i = next;
+    }
+
+    return (lfs->free.off + off) % lfs->cfg->block_count;
+}
+
 static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
     while (true) {
-        while (lfs->free.i != lfs->free.size) {
-            lfs_block_t off = lfs->free.i;
-            lfs->free.i += 1;
-            lfs->free.ack -= 1;
-
-            if (!(lfs->free.buffer[off / 32] & (1U << (off % 32)))) {
-                // found a free block
-                *block = (lfs->free.off + off) % lfs->cfg->block_count;
-
-                // eagerly find next off so an alloc ack can
-                // discredit old lookahead blocks
-                while (lfs->free.i != lfs->free.size &&
-                        (lfs->free.buffer[lfs->free.i / 32]
-                            & (1U << (lfs->free.i % 32)))) {
-                    lfs->free.i += 1;
-                    lfs->free.ack -= 1;
-                }
+        lfs_block_t off = lfs_alloc_scan(lfs, lfs->free.i);
+        lfs->free.ack -= off - lfs->free.i;
+        lfs->free.i = off;
 
-                return 0;
-            }
+        if (off != lfs->free.size) {
+            // found a free block
+            *block = lfs_alloc_take(lfs, off);
+            return 0;
         }
 
         // check if we have looked at all blocks since last ack
@@ -487,6 +507,44 @@ static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
     }
 }
 
+// Offset of block in the lookahead window if the allocator can hand it out
+static lfs_block_t lfs_alloc_offset(lfs_t *lfs, lfs_block_t block) {
+    if (block >= lfs->cfg->block_count) {
+        return LFS_BLOCK_NULL;
+    }
+
+    lfs_block_t off = ((block - lfs->free.off)
+            + lfs->cfg->block_count) % lfs->cfg->block_count;
+    if (off < lfs->free.i || off >= lfs->free.size ||
+            (lfs->free.buffer[off / 32] & (1U << (off % 32)))) {
+        return LFS_BLOCK_NULL;
+    }
+
+    return off;
+}
+
+bool lfs_alloc_isfree(lfs_t *lfs, lfs_block_t block) {
+    return lfs_alloc_offset(lfs, block) != LFS_BLOCK_NULL;
+}
+
+// Allocate a data block for a file of count blocks ending in head, the
+// alloc hook gets a say before the next free block is taken
+static int lfs_alloc_data(lfs_t *lfs, lfs_block_t head, lfs_size_t count,
+        lfs_block_t *block) {
+    lfs_block_t pick;
+    if (lfs->cfg->alloc && lfs->free.size &&
+            lfs->cfg->alloc(lfs, head, count, &pick)) {
+        lfs_block_t off = lfs_alloc_offset(lfs, pick);
+        LFS_ASSERT(off != LFS_BLOCK_NULL);
+        if (off != LFS_BLOCK_NULL) {
+            *block = lfs_alloc_take(lfs, off);
+            return 0;
+        }
+    }
+
+    return lfs_alloc(lfs, block);
+}
+
 static void lfs_alloc_ack(lfs_t *lfs) {
     lfs->free.ack = lfs->cfg->block_count;
 }
@@ -2167,8 +2225,14 @@ static int lfs_ctz_extend(lfs_t *lfs,
         lfs_block_t *block, lfs_off_t *off) {
     while (true) {
         // go ahead and grab a block
+        lfs_size_t count = 0;
+        if (size != 0) {
+            lfs_off_t last = size - 1;
+            count = lfs_ctz_index(lfs, &last) + 1;
+        }
+
         lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
+        int err = lfs_alloc_data(lfs, head, count, &nblock);
         if (err) {
             return err;
         }
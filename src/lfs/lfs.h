@@ -147,6 +147,8 @@ enum lfs_whence_flags {
 };
 
 
+struct lfs;
+
 // Configuration provided during initialization of the littlefs
 struct lfs_config {
     // Opaque user provided context that can be used to pass
@@ -240,6 +242,14 @@ struct lfs_config {
     // larger attributes size but must be <= LFS_ATTR_MAX. Defaults to
     // LFS_ATTR_MAX when zero.
     lfs_size_t attr_max;
+
+    // Optional hook picking the blocks of file data, for instance to keep
+    // files in runs of consecutive blocks. Gets the block the file ends in
+    // and the number of blocks it has, 0 for a new file. Returns true with a
+    // block lfs_alloc_isfree reports as free, or false for the next free
+    // block. Defaults to the next free block when NULL.
+    bool (*alloc)(struct lfs *lfs, lfs_block_t head, lfs_size_t count,
+            lfs_block_t *block);
 };
 
 // File info structure
@@ -619,6 +629,12 @@ int lfs_dir_rewind(lfs_t *lfs, lfs_dir_t *dir);
 // Returns the number of allocated blocks, or a negative error code on failure.
 lfs_ssize_t lfs_fs_size(lfs_t *lfs);
 
+// Checks whether the allocator can hand out a block right now
+//
+// Blocks are only known to be free after the allocator has scanned the
+// filesystem, so this is meant to be called from the alloc hook.
+bool lfs_alloc_isfree(lfs_t *lfs, lfs_block_t block);
+
 // Traverse through all blocks in use by the filesystem
 //
 // The provided callback will be called with each block address that is
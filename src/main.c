@@ -20,6 +20,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -35,32 +36,89 @@ static uint8_t m_buffer[4096];
 typedef enum {
     ACTION_NONE = 0,
     ACTION_EXTRACT,
-    ACTION_CREATE
+    ACTION_CREATE,
+    ACTION_REPLAY
 } action_t;
 
 struct options {
     const char *directory;
-    const char *image;
+    const char *replay;
     action_t action;
-    size_t name_max;
-    size_t io_size;
-    size_t block_size;
-    size_t block_count;
+    struct vfs_lfs_options lfs;
+};
+
+enum {
+    OPTION_BACKEND = 0x100,
+    OPTION_FILL,
+    OPTION_CACHE,
+    OPTION_READAHEAD,
+    OPTION_SYNC,
+    OPTION_FORMAT,
+    OPTION_TRIM,
+    OPTION_OFFSET,
+    OPTION_LENGTH,
+    OPTION_PAGES,
+    OPTION_DRY_RUN,
+    OPTION_TIMING,
+    OPTION_TRACE,
+    OPTION_REPLAY,
+    OPTION_STATS,
+    OPTION_ALLOC
+};
+
+static const struct option m_long_options[] = {
+    {"backend", required_argument, NULL, OPTION_BACKEND},
+    {"fill", required_argument, NULL, OPTION_FILL},
+    {"cache", required_argument, NULL, OPTION_CACHE},
+    {"readahead", required_argument, NULL, OPTION_READAHEAD},
+    {"sync", required_argument, NULL, OPTION_SYNC},
+    {"format", required_argument, NULL, OPTION_FORMAT},
+    {"trim", no_argument, NULL, OPTION_TRIM},
+    {"offset", required_argument, NULL, OPTION_OFFSET},
+    {"length", required_argument, NULL, OPTION_LENGTH},
+    {"pages", required_argument, NULL, OPTION_PAGES},
+    {"dry-run", no_argument, NULL, OPTION_DRY_RUN},
+    {"timing", required_argument, NULL, OPTION_TIMING},
+    {"trace", required_argument, NULL, OPTION_TRACE},
+    {"replay", required_argument, NULL, OPTION_REPLAY},
+    {"stats", optional_argument, NULL, OPTION_STATS},
+    {"alloc", required_argument, NULL, OPTION_ALLOC},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
 };
 
 static void usage(const char *name)
 {
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "   %s [-n <max name length>] [-s <io size>] [-b <block size>] [-a <number of blocks>] -i <lfs image> -d <directory> (-x | -c)\n", name);
+    fprintf(stderr, "   %s [-n <max name length>] [-s <io size>] [-b <block size>] [-a <number of blocks>] [--backend <name>] [--fill <mode>] [--cache <size>] [--readahead <blocks>] [--sync <mode>] [--format <name>] [--trim] [--offset <bytes>] [--length <bytes>] [--pages <size>] [--dry-run] [--timing <read>,<prog>,<erase>] [--trace <file>] [--stats[=<file>]] [--alloc <policy>] -i <lfs image> -d <directory> (-x | -c)\n", name);
+    fprintf(stderr, "   %s [--backend <name>] [--fill <mode>] [--cache <size>] [--readahead <blocks>] [--sync <mode>] [--format <name>] [--offset <bytes>] [--pages <size>] [--stats[=<file>]] -i <lfs image> --replay <trace>\n", name);
     fprintf(stderr, "   \n");
     fprintf(stderr, "   -n <max name length>   Maximum file name length.\n");
     fprintf(stderr, "   -s <io size>           IO size [default: 512].\n");
     fprintf(stderr, "   -b <block size>        Block size [default: 4096].\n");
     fprintf(stderr, "   -a <number of blocks>  Number of blocks [default: 4059].\n");
-    fprintf(stderr, "   -i <lfs image>         Path to lfs image.\n");
+    fprintf(stderr, "   -i <lfs image>         Path to lfs image, - streams it through stdin or stdout.\n");
     fprintf(stderr, "   -d <directory>         Path to root directory.\n");
     fprintf(stderr, "   -x                     Extract files from image.\n");
     fprintf(stderr, "   -c                     Create image.\n");
+    fprintf(stderr, "   --backend <name>       Image access method: stdio, file, mmap, ram, uring, direct [default: mmap, then file].\n");
+    fprintf(stderr, "   --fill <mode>          Erase a new image up front (full) or leave unused blocks sparse (lazy) [default: full].\n");
+    fprintf(stderr, "   --cache <size>         Memory for whole-block write-back cache, K/M/G suffix allowed [default: 0, off].\n");
+    fprintf(stderr, "   --readahead <blocks>   Prefetch blocks ahead of sequential reads into the cache [default: 0, off].\n");
+    fprintf(stderr, "   --sync <mode>          When the image reaches stable storage: none, end, commit, paranoid [default: end].\n");
+    fprintf(stderr, "   --format <name>        Image file format: raw, or sparse for an Android sparse image [default: raw].\n");
+    fprintf(stderr, "   --trim                 Fill a new image from block 0 and cut it after the highest block in use.\n");
+    fprintf(stderr, "   --offset <bytes>       Partition offset inside the image, which is then updated in place, K/M/G suffix allowed.\n");
+    fprintf(stderr, "   --length <bytes>       Partition length, instead of -a, K/M/G suffix allowed.\n");
+    fprintf(stderr, "   --pages <size>         Pages behind in-memory images: huge, falling back to normal ones, or normal [default: huge].\n");
+    fprintf(stderr, "   --dry-run              With -c, report the blocks the image needs without writing it, -i is optional.\n");
+    fprintf(stderr, "   --timing <r>,<p>,<e>   Estimate flash time from read per byte, program per page (-s) and erase per block\n");
+    fprintf(stderr, "                          latencies, ns/us/ms/s suffix allowed [default: ns], e.g. 20ns,700us,45ms.\n");
+    fprintf(stderr, "   --trace <file>         Record every littlefs block device call to file.\n");
+    fprintf(stderr, "   --replay <trace>       Run a recorded trace against the image at full speed, instead of -x or -c.\n");
+    fprintf(stderr, "   --stats[=<file>]       Count calls, bytes and time per block device call, with size and latency\n");
+    fprintf(stderr, "                          histograms, printed as text when the image is closed, or written to file as JSON.\n");
+    fprintf(stderr, "   --alloc <policy>       Where file data goes: next free block, or contiguous runs per file [default: next].\n");
     exit(EXIT_FAILURE);
 }
 
@@ -79,16 +137,17 @@ static int process_file(struct vfs *vfs, struct vfs *target_vfs, const char *pat
     in = vfs->open(vfs, path, O_RDONLY);
     CHECK_ERROR(in != NULL, -1, "vfs->open() failed");
 
-    int32_t rb = 0;
-    while ((rb = vfs->read(vfs, in, m_buffer, sizeof(m_buffer))) >= 0) {
-        int32_t wb = target_vfs->write(target_vfs, out, m_buffer, rb);
-        CHECK_ERROR(wb == rb, -1, "target_vfs->write() failed");
-        if (rb != sizeof(m_buffer)) {
-            break;
+    // short reads and writes are legal, only a zero read ends the file
+    ssize_t rb = 0;
+    while ((rb = vfs->read(vfs, in, m_buffer, sizeof(m_buffer))) > 0) {
+        for (ssize_t done = 0; done < rb;) {
+            ssize_t wb = target_vfs->write(target_vfs, out, m_buffer + done, rb - done);
+            CHECK_ERROR(wb > 0, -1, "target_vfs->write() failed: %zd", wb);
+            done += wb;
         }
     }
 
-    CHECK_ERROR(rb >= 0, -1, "vfs->read() failed: %d", rb);
+    CHECK_ERROR(rb == 0, -1, "vfs->read() failed: %zd", rb);
 
 done:
     if (in != NULL) {
@@ -163,6 +222,153 @@ done:
     return result;
 }
 
+static int string_to_backend(const char *str, bd_type_t *backend)
+{
+    int result = 0;
+
+    CHECK_ERROR(str != NULL, -1, "str == NULL");
+    CHECK_ERROR(backend != NULL, -1, "backend == NULL");
+
+    if (strcmp(str, "stdio") == 0) {
+        *backend = BD_TYPE_STDIO;
+    } else if (strcmp(str, "file") == 0) {
+        *backend = BD_TYPE_FILE;
+    } else if (strcmp(str, "mmap") == 0) {
+        *backend = BD_TYPE_MMAP;
+    } else if (strcmp(str, "ram") == 0) {
+        *backend = BD_TYPE_RAM;
+    } else if (strcmp(str, "uring") == 0) {
+        *backend = BD_TYPE_URING;
+    } else if (strcmp(str, "direct") == 0) {
+        *backend = BD_TYPE_DIRECT;
+    } else {
+        CHECK_ERROR(false, -1, "unknown backend: %s", str);
+    }
+
+done:
+    return result;
+}
+
+static int string_to_fill(const char *str, vfs_lfs_fill_t *fill)
+{
+    int result = 0;
+
+    CHECK_ERROR(str != NULL, -1, "str == NULL");
+    CHECK_ERROR(fill != NULL, -1, "fill == NULL");
+
+    if (strcmp(str, "full") == 0) {
+        *fill = VFS_LFS_FILL_FULL;
+    } else if (strcmp(str, "lazy") == 0) {
+        *fill = VFS_LFS_FILL_LAZY;
+    } else {
+        CHECK_ERROR(false, -1, "unknown fill mode: %s", str);
+    }
+
+done:
+    return result;
+}
+
+static int string_to_pages(const char *str, bd_ram_pages_t *pages)
+{
+    int result = 0;
+
+    CHECK_ERROR(str != NULL, -1, "str == NULL");
+    CHECK_ERROR(pages != NULL, -1, "pages == NULL");
+
+    if (strcmp(str, "huge") == 0) {
+        *pages = BD_RAM_PAGES_HUGE;
+    } else if (strcmp(str, "normal") == 0) {
+        *pages = BD_RAM_PAGES_NORMAL;
+    } else {
+        CHECK_ERROR(false, -1, "unknown page size: %s", str);
+    }
+
+done:
+    return result;
+}
+
+static int string_to_format(const char *str, vfs_lfs_format_t *format)
+{
+    int result = 0;
+
+    CHECK_ERROR(str != NULL, -1, "str == NULL");
+    CHECK_ERROR(format != NULL, -1, "format == NULL");
+
+    if (strcmp(str, "raw") == 0) {
+        *format = VFS_LFS_FORMAT_RAW;
+    } else if (strcmp(str, "sparse") == 0) {
+        *format = VFS_LFS_FORMAT_SPARSE;
+    } else {
+        CHECK_ERROR(false, -1, "unknown format: %s", str);
+    }
+
+done:
+    return result;
+}
+
+// Text goes to the log on stdout, JSON gets a file of its own so that it can be parsed.
+static int string_to_stats(const char *str, vfs_lfs_stats_t *stats, const char **file)
+{
+    int result = 0;
+
+    CHECK_ERROR(stats != NULL, -1, "stats == NULL");
+    CHECK_ERROR(file != NULL, -1, "file == NULL");
+
+    if (str == NULL || strcmp(str, "text") == 0) {
+        *stats = VFS_LFS_STATS_TEXT;
+        *file = NULL;
+    } else {
+        CHECK_ERROR(*str != '\0', -1, "empty stats file name");
+        *stats = VFS_LFS_STATS_JSON;
+        *file = str;
+    }
+
+done:
+    return result;
+}
+
+static int string_to_alloc(const char *str, vfs_lfs_alloc_t *alloc)
+{
+    int result = 0;
+
+    CHECK_ERROR(str != NULL, -1, "str == NULL");
+    CHECK_ERROR(alloc != NULL, -1, "alloc == NULL");
+
+    if (strcmp(str, "next") == 0) {
+        *alloc = VFS_LFS_ALLOC_NEXT;
+    } else if (strcmp(str, "contiguous") == 0) {
+        *alloc = VFS_LFS_ALLOC_CONTIGUOUS;
+    } else {
+        CHECK_ERROR(false, -1, "unknown allocation policy: %s", str);
+    }
+
+done:
+    return result;
+}
+
+static int string_to_sync(const char *str, vfs_lfs_sync_t *sync)
+{
+    int result = 0;
+
+    CHECK_ERROR(str != NULL, -1, "str == NULL");
+    CHECK_ERROR(sync != NULL, -1, "sync == NULL");
+
+    if (strcmp(str, "none") == 0) {
+        *sync = VFS_LFS_SYNC_NONE;
+    } else if (strcmp(str, "end") == 0) {
+        *sync = VFS_LFS_SYNC_END;
+    } else if (strcmp(str, "commit") == 0) {
+        *sync = VFS_LFS_SYNC_COMMIT;
+    } else if (strcmp(str, "paranoid") == 0) {
+        *sync = VFS_LFS_SYNC_PARANOID;
+    } else {
+        CHECK_ERROR(false, -1, "unknown sync mode: %s", str);
+    }
+
+done:
+    return result;
+}
+
 static int string_to_size(const char *str, size_t *size)
 {
     int result = 0;
@@ -183,6 +389,93 @@ done:
     return result;
 }
 
+static int string_to_bytes(const char *str, uint64_t *size)
+{
+    int result = 0;
+
+    CHECK_ERROR(str != NULL, -1, "str == NULL");
+    CHECK_ERROR(size != NULL, -1, "size == NULL");
+
+    char *endptr = NULL;
+    errno = 0;
+
+    unsigned long long value = strtoull(str, &endptr, 10);
+    CHECK_ERROR(endptr != str && errno == 0, -1, "invalid number: %s", str);
+
+    unsigned shift = 0;
+    switch (*endptr) {
+        case 'K': case 'k': shift = 10; endptr++; break;
+        case 'M': case 'm': shift = 20; endptr++; break;
+        case 'G': case 'g': shift = 30; endptr++; break;
+        default: break;
+    }
+    CHECK_ERROR(*endptr == '\0', -1, "invalid suffix: %s", str);
+    CHECK_ERROR(value <= (UINT64_MAX >> shift), -1, "conversion failed, value is too large");
+
+    *size = (uint64_t)value << shift;
+
+done:
+    return result;
+}
+
+// Parses one duration into nanoseconds, endptr is left on the character after it.
+static int string_to_duration(const char *str, uint64_t *ns, const char **endptr)
+{
+    int result = 0;
+
+    CHECK_ERROR(str != NULL, -1, "str == NULL");
+    CHECK_ERROR(ns != NULL, -1, "ns == NULL");
+
+    char *end = NULL;
+    errno = 0;
+
+    double value = strtod(str, &end);
+    CHECK_ERROR(end != str && errno == 0 && value >= 0, -1, "invalid duration: %s", str);
+
+    static const struct {
+        const char *suffix;
+        double scale;
+    } units[] = {{"ns", 1}, {"us", 1e3}, {"ms", 1e6}, {"s", 1e9}};
+
+    for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+        size_t length = strlen(units[i].suffix);
+        if (strncmp(end, units[i].suffix, length) == 0) {
+            value *= units[i].scale;
+            end += length;
+            break;
+        }
+    }
+    CHECK_ERROR(value < 1e18, -1, "duration is too long: %s", str);
+
+    *ns = (uint64_t)(value + 0.5);
+    *endptr = end;
+
+done:
+    return result;
+}
+
+static int string_to_timing(const char *str, struct vfs_lfs_timing *timing)
+{
+    int result = 0;
+
+    CHECK_ERROR(str != NULL, -1, "str == NULL");
+    CHECK_ERROR(timing != NULL, -1, "timing == NULL");
+
+    uint64_t *fields[] = {&timing->read_byte_ns, &timing->prog_page_ns, &timing->erase_block_ns};
+
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        const char *end = NULL;
+        CHECK_ERROR(string_to_duration(str, fields[i], &end) == 0, -1, "string_to_duration() failed");
+
+        char separator = i + 1 < sizeof(fields) / sizeof(fields[0]) ? ',' : '\0';
+        CHECK_ERROR(*end == separator, -1, "expected <read>,<prog>,<erase>: %s", str);
+        str = end + 1;
+    }
+
+done:
+    return result;
+}
+
 int main(int argc, char **argv)
 {
     int result = EXIT_SUCCESS;
@@ -192,10 +485,10 @@ int main(int argc, char **argv)
     struct vfs *vfs_native = NULL;
 
     int opt = 0;
-    while ((opt = getopt(argc, argv, "i:d:n:s:b:a:cxh?")) != -1) {
+    while ((opt = getopt_long(argc, argv, "i:d:n:s:b:a:cxh?", m_long_options, NULL)) != -1) {
         switch (opt) {
             case 'i':
-                options.image = optarg;
+                options.lfs.image = optarg;
                 break;
             case 'd':
                 options.directory = optarg;
@@ -209,16 +502,70 @@ int main(int argc, char **argv)
                 options.action = ACTION_EXTRACT;
             } break;
             case 'n': {
-                CHECK_ERROR(string_to_size(optarg, &options.name_max) == 0, 1, "string_to_size() failed");
+                CHECK_ERROR(string_to_size(optarg, &options.lfs.name_max) == 0, 1, "string_to_size() failed");
             } break;
             case 's': {
-                CHECK_ERROR(string_to_size(optarg, &options.io_size) == 0, 1, "string_to_size() failed");
+                CHECK_ERROR(string_to_size(optarg, &options.lfs.io_size) == 0, 1, "string_to_size() failed");
             } break;
             case 'b': {
-                CHECK_ERROR(string_to_size(optarg, &options.block_size) == 0, 1, "string_to_size() failed");
+                CHECK_ERROR(string_to_size(optarg, &options.lfs.block_size) == 0, 1, "string_to_size() failed");
             } break;
             case 'a': {
-                CHECK_ERROR(string_to_size(optarg, &options.block_count) == 0, 1, "string_to_size() failed");
+                CHECK_ERROR(string_to_size(optarg, &options.lfs.block_count) == 0, 1, "string_to_size() failed");
+            } break;
+            case OPTION_BACKEND: {
+                CHECK_ERROR(string_to_backend(optarg, &options.lfs.backend) == 0, 1, "string_to_backend() failed");
+            } break;
+            case OPTION_FILL: {
+                CHECK_ERROR(string_to_fill(optarg, &options.lfs.fill) == 0, 1, "string_to_fill() failed");
+            } break;
+            case OPTION_CACHE: {
+                uint64_t budget = 0;
+                CHECK_ERROR(string_to_bytes(optarg, &budget) == 0, 1, "string_to_bytes() failed");
+                CHECK_ERROR(budget <= SIZE_MAX, 1, "cache budget does not fit in the address space");
+                options.lfs.cache_budget = budget;
+            } break;
+            case OPTION_READAHEAD: {
+                CHECK_ERROR(string_to_size(optarg, &options.lfs.readahead) == 0, 1, "string_to_size() failed");
+            } break;
+            case OPTION_SYNC: {
+                CHECK_ERROR(string_to_sync(optarg, &options.lfs.sync) == 0, 1, "string_to_sync() failed");
+            } break;
+            case OPTION_FORMAT: {
+                CHECK_ERROR(string_to_format(optarg, &options.lfs.format) == 0, 1, "string_to_format() failed");
+            } break;
+            case OPTION_TRIM: {
+                options.lfs.trim = true;
+            } break;
+            case OPTION_OFFSET: {
+                CHECK_ERROR(string_to_bytes(optarg, &options.lfs.offset) == 0, 1, "string_to_bytes() failed");
+                options.lfs.in_place = true;
+            } break;
+            case OPTION_LENGTH: {
+                CHECK_ERROR(string_to_bytes(optarg, &options.lfs.length) == 0, 1, "string_to_bytes() failed");
+            } break;
+            case OPTION_PAGES: {
+                CHECK_ERROR(string_to_pages(optarg, &options.lfs.pages) == 0, 1, "string_to_pages() failed");
+            } break;
+            case OPTION_DRY_RUN: {
+                options.lfs.dry_run = true;
+            } break;
+            case OPTION_TIMING: {
+                CHECK_ERROR(string_to_timing(optarg, &options.lfs.timing) == 0, 1, "string_to_timing() failed");
+            } break;
+            case OPTION_STATS: {
+                CHECK_ERROR(string_to_stats(optarg, &options.lfs.stats, &options.lfs.stats_file) == 0, 1, "string_to_stats() failed");
+            } break;
+            case OPTION_ALLOC: {
+                CHECK_ERROR(string_to_alloc(optarg, &options.lfs.alloc) == 0, 1, "string_to_alloc() failed");
+            } break;
+            case OPTION_TRACE: {
+                options.lfs.trace = optarg;
+            } break;
+            case OPTION_REPLAY: {
+                CHECK_ERROR(options.action == ACTION_NONE, 1, "REQUIRED -x OR -c OR --replay");
+                options.action = ACTION_REPLAY;
+                options.replay = optarg;
             } break;
             case 'h':
             /* FALLTHROUGH */
@@ -231,30 +578,40 @@ int main(int argc, char **argv)
     }
 
     CHECK_ERROR(optind == argc, 1, "Invalid argument count");
-    CHECK_ERROR(options.image != NULL, 1, "-i required");
-    CHECK_ERROR(options.directory != NULL, 1, "-d required");
+    CHECK_ERROR(options.lfs.image != NULL || options.lfs.dry_run, 1, "-i required");
+    CHECK_ERROR(options.action != ACTION_EXTRACT || !options.lfs.dry_run, 1, "--dry-run requires -c");
+    CHECK_ERROR(options.directory != NULL || options.action == ACTION_REPLAY, 1, "-d required");
 
-    vfs_native = vfs_native_get(options.directory);
+    if (options.directory != NULL) {
+        vfs_native = vfs_native_get(options.directory);
+    }
 
     switch (options.action) {
         case ACTION_EXTRACT: {
-            vfs_lfs = vfs_lfs_get(options.image, false, options.name_max, options.io_size, options.block_size,
-                                  options.block_count);
+            options.lfs.write = false;
+            vfs_lfs = vfs_lfs_get(&options.lfs);
+            CHECK_ERROR(vfs_lfs != NULL, 2, "vfs_lfs_get() failed");
 
             int err = vfs_lfs->mount(vfs_lfs);
             CHECK_ERROR(err == 0, 2, "vfs->mount() failed: %d", err);
 
-            traversal(vfs_lfs, vfs_native, "/");
+            err = traversal(vfs_lfs, vfs_native, "/");
+            CHECK_ERROR(err == 0, 2, "traversal() failed: %d", err);
         } break;
         case ACTION_CREATE: {
-            vfs_lfs = vfs_lfs_get(options.image, true, options.name_max, options.io_size, options.block_size,
-                                  options.block_count);
+            options.lfs.write = true;
+            vfs_lfs = vfs_lfs_get(&options.lfs);
             CHECK_ERROR(vfs_lfs != NULL, 2, "vfs_lfs_get() failed");
 
             int err = vfs_lfs->mount(vfs_lfs);
             CHECK_ERROR(err == 0, 2, "vfs->mount() failed: %d", err);
 
-            traversal(vfs_native, vfs_lfs, "/");
+            err = traversal(vfs_native, vfs_lfs, "/");
+            CHECK_ERROR(err == 0, 2, "traversal() failed: %d", err);
+        } break;
+        case ACTION_REPLAY: {
+            int err = vfs_lfs_replay(&options.lfs, options.replay);
+            CHECK_ERROR(err == 0, 2, "vfs_lfs_replay() failed: %d", err);
         } break;
         case ACTION_NONE:
             ERROR("REQUIRED -x OR -c");
@@ -264,9 +621,14 @@ int main(int argc, char **argv)
 
 done:
     if (vfs_lfs != NULL) {
+        if (result != EXIT_SUCCESS) {
+            vfs_lfs_discard(vfs_lfs);
+        }
+
         int err = vfs_lfs->unmount(vfs_lfs);
         if (err != 0) {
             ERROR("vfs->unmount: %d", err);
+            result = 2;
         }
     }
 
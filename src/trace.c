@@ -0,0 +1,183 @@
+/**
+ * Copyright 2019 Sergey Tyultyaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "macro.h"
+
+#define TRACE_MAGIC "LFSTRACE"
+#define TRACE_VERSION 1
+#define HEADER_SIZE 32
+#define RECORD_SIZE 24
+
+struct trace
+{
+    FILE *file;
+    uint64_t start;
+};
+
+static struct trace m_trace = {0};
+
+static void put_le32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t now(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct trace *trace_create(const char *path, const struct trace_header *header)
+{
+    struct trace *result = NULL;
+
+    CHECK_ERROR(path != NULL, NULL, "path == NULL");
+    CHECK_ERROR(header != NULL, NULL, "header == NULL");
+    CHECK_ERROR(m_trace.file == NULL, NULL, "a trace is open already");
+
+    m_trace.file = fopen(path, "wb");
+    CHECK_ERROR(m_trace.file != NULL, NULL, "fopen(%s) failed: %s", path, strerror(errno));
+    setvbuf(m_trace.file, NULL, _IOFBF, 1 << 20);
+
+    uint8_t buffer[HEADER_SIZE] = {0};
+    memcpy(buffer, TRACE_MAGIC, 8);
+    put_le32(buffer + 8, TRACE_VERSION);
+    put_le32(buffer + 12, header->block_size);
+    put_le32(buffer + 16, header->block_count);
+    put_le32(buffer + 20, header->read_size);
+    put_le32(buffer + 24, header->prog_size);
+    put_le32(buffer + 28, header->write);
+
+    size_t bytes = fwrite(buffer, 1, sizeof(buffer), m_trace.file);
+    CHECK_ERROR(bytes == sizeof(buffer), NULL, "fwrite() failed: %s", strerror(errno));
+
+    m_trace.start = now();
+    result = &m_trace;
+
+done:
+    if (result == NULL && m_trace.file != NULL) {
+        fclose(m_trace.file);
+        m_trace.file = NULL;
+    }
+    return result;
+}
+
+struct trace *trace_open(const char *path, struct trace_header *header)
+{
+    struct trace *result = NULL;
+
+    CHECK_ERROR(path != NULL, NULL, "path == NULL");
+    CHECK_ERROR(header != NULL, NULL, "header == NULL");
+    CHECK_ERROR(m_trace.file == NULL, NULL, "a trace is open already");
+
+    m_trace.file = fopen(path, "rb");
+    CHECK_ERROR(m_trace.file != NULL, NULL, "fopen(%s) failed: %s", path, strerror(errno));
+    setvbuf(m_trace.file, NULL, _IOFBF, 1 << 20);
+
+    uint8_t buffer[HEADER_SIZE] = {0};
+    size_t bytes = fread(buffer, 1, sizeof(buffer), m_trace.file);
+    CHECK_ERROR(bytes == sizeof(buffer), NULL, "trace header is truncated");
+    CHECK_ERROR(memcmp(buffer, TRACE_MAGIC, 8) == 0, NULL, "not a trace: %s", path);
+    CHECK_ERROR(get_le32(buffer + 8) == TRACE_VERSION, NULL, "unsupported trace version: %u", get_le32(buffer + 8));
+
+    header->block_size = get_le32(buffer + 12);
+    header->block_count = get_le32(buffer + 16);
+    header->read_size = get_le32(buffer + 20);
+    header->prog_size = get_le32(buffer + 24);
+    header->write = get_le32(buffer + 28) != 0;
+
+    result = &m_trace;
+
+done:
+    if (result == NULL && m_trace.file != NULL) {
+        fclose(m_trace.file);
+        m_trace.file = NULL;
+    }
+    return result;
+}
+
+int trace_write(struct trace *trace, trace_op_t op, uint32_t block, uint32_t off, uint32_t size)
+{
+    int result = 0;
+
+    uint64_t time = now() - trace->start;
+
+    uint8_t buffer[RECORD_SIZE] = {0};
+    buffer[0] = op;
+    put_le32(buffer + 4, block);
+    put_le32(buffer + 8, off);
+    put_le32(buffer + 12, size);
+    put_le32(buffer + 16, (uint32_t)time);
+    put_le32(buffer + 20, (uint32_t)(time >> 32));
+
+    size_t bytes = fwrite(buffer, 1, sizeof(buffer), trace->file);
+    CHECK_ERROR(bytes == sizeof(buffer), -1, "fwrite() failed: %s", strerror(errno));
+
+done:
+    return result;
+}
+
+int trace_read(struct trace *trace, struct trace_record *record)
+{
+    int result = 1;
+
+    uint8_t buffer[RECORD_SIZE] = {0};
+    size_t bytes = fread(buffer, 1, sizeof(buffer), trace->file);
+    if (bytes == 0 && feof(trace->file)) {
+        result = 0;
+        goto done;
+    }
+    CHECK_ERROR(bytes == sizeof(buffer), -1, "trace record is truncated");
+    CHECK_ERROR(buffer[0] <= TRACE_OP_SYNC, -1, "unknown trace operation: %u", buffer[0]);
+
+    record->op = buffer[0];
+    record->block = get_le32(buffer + 4);
+    record->off = get_le32(buffer + 8);
+    record->size = get_le32(buffer + 12);
+    record->time = get_le32(buffer + 16) | (uint64_t)get_le32(buffer + 20) << 32;
+
+done:
+    return result;
+}
+
+int trace_close(struct trace *trace)
+{
+    int result = 0;
+
+    int err = fclose(trace->file);
+    trace->file = NULL;
+    CHECK_ERROR(err == 0, -1, "fclose() failed: %s", strerror(errno));
+
+done:
+    return result;
+}
@@ -0,0 +1,62 @@
+// Copyright 2019 Sergey Tyultyaev
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Log of littlefs block device calls: a header with the geometry, then one fixed-size record per call.
+
+typedef enum {
+    TRACE_OP_READ = 0,
+    TRACE_OP_PROG,
+    TRACE_OP_ERASE,
+    TRACE_OP_SYNC
+} trace_op_t;
+
+struct trace_header
+{
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t read_size;
+    uint32_t prog_size;
+    // the image was built rather than read
+    bool write;
+};
+
+struct trace_record
+{
+    trace_op_t op;
+    uint32_t block;
+    uint32_t off;
+    uint32_t size;
+    // ns since the trace was started
+    uint64_t time;
+};
+
+struct trace;
+
+struct trace *trace_create(const char *path, const struct trace_header *header);
+
+struct trace *trace_open(const char *path, struct trace_header *header);
+
+int trace_write(struct trace *trace, trace_op_t op, uint32_t block, uint32_t off, uint32_t size);
+
+// Returns 1 with the next record, 0 at the end of the trace and -1 on errors.
+int trace_read(struct trace *trace, struct trace_record *record);
+
+int trace_close(struct trace *trace);
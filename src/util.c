@@ -16,9 +16,19 @@
 
 #include "util.h"
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <io.h>
+#endif //_WIN32
 
 #include "macro.h"
 
@@ -44,3 +54,73 @@ char *append_dir_alloc(const char *dir, const char *path)
 done:
     return result;
 }
+
+bool is_stream(const char *path)
+{
+    return path != NULL && strcmp(path, "-") == 0;
+}
+
+int stream_stdout(void)
+{
+    fflush(stdout);
+
+    int fd = dup(STDOUT_FILENO);
+    if (fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        close(fd);
+        fd = -1;
+    }
+#ifdef _WIN32
+    if (fd >= 0) {
+        _setmode(fd, _O_BINARY);
+    }
+#endif //_WIN32
+    return fd;
+}
+
+int stream_stdin(void)
+{
+    int fd = dup(STDIN_FILENO);
+#ifdef _WIN32
+    if (fd >= 0) {
+        _setmode(fd, _O_BINARY);
+    }
+#endif //_WIN32
+    return fd;
+}
+
+int sync_fd(int fd, bool full)
+{
+#if defined(_WIN32)
+    return _commit(fd);
+#elif defined(__APPLE__)
+    // fdatasync() is not declared on macOS
+    return fsync(fd);
+#else
+    return full ? fsync(fd) : fdatasync(fd);
+#endif
+}
+
+int sync_dir(const char *path)
+{
+    int result = 0;
+
+#ifndef _WIN32
+    CHECK_ERROR(path != NULL, -1, "path == NULL");
+
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : (size_t)(slash - path));
+    CHECK_ERROR(dir != NULL, -1, "strdup() failed");
+
+    int fd = open(dir, O_RDONLY);
+    free(dir);
+    CHECK_ERROR(fd >= 0, -1, "open() failed: %s", strerror(errno));
+
+    int err = fsync(fd);
+    int fsync_errno = errno;
+    close(fd);
+    CHECK_ERROR(err == 0, -1, "fsync() failed: %s", strerror(fsync_errno));
+
+done:
+#endif //_WIN32
+    return result;
+}
@@ -14,4 +14,21 @@
 
 #pragma once
 
+#include <stdbool.h>
+
 char *append_dir_alloc(const char *dir, const char *path);
+
+// "-" names stdin or stdout instead of a file.
+bool is_stream(const char *path);
+
+// Returns a descriptor for stdout and points fd 1 at stderr, so that messages do not end up in binary output.
+int stream_stdout(void);
+
+// Returns a descriptor for stdin in binary mode.
+int stream_stdin(void);
+
+// Commits fd to stable storage, with fdatasync() unless full is set.
+int sync_fd(int fd, bool full);
+
+// Commits the directory entry of path, so that a newly created or renamed file survives a crash.
+int sync_dir(const char *path);
@@ -14,6 +14,7 @@
 
 #pragma once
 
+#include <sys/types.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -35,8 +36,8 @@ struct vfs
     void *opaque;
     void *(*open)(struct vfs *vfs, const char *pathname, int flags);
     int (*close)(struct vfs *vfs, void *fd);
-    int32_t (*read)(struct vfs *vfs, void *fd, void *buf, size_t count);
-    int32_t (*write)(struct vfs *vfs, void *fd, const void *buf, size_t count);
+    ssize_t (*read)(struct vfs *vfs, void *fd, void *buf, size_t count);
+    ssize_t (*write)(struct vfs *vfs, void *fd, const void *buf, size_t count);
     int (*mount)(struct vfs *vfs);
     int (*unmount)(struct vfs *vfs);
     void *(*opendir)(struct vfs *vfs, const char *path);
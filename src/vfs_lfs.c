@@ -24,16 +24,91 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "vfs.h"
+#include "alloc.h"
+#include "bd_cache.h"
+#include "bd_direct.h"
+#include "bd_file.h"
+#include "bd_mmap.h"
+#include "bd_null.h"
+#include "bd_ram.h"
+#include "bd_sparse.h"
+#include "bd_stdio.h"
+#include "bd_uring.h"
+#include "bitmap.h"
 #include "lfs/lfs.h"
+#include "trace.h"
+#include "util.h"
 
 #define BLOCK_SIZE 4096
 #define IO_SIZE 256
 
+#define SIZE_BUCKETS 34
+#define LATENCY_BUCKETS 40
+#define CALL_TYPES (TRACE_OP_SYNC + 1)
+#define NO_BLOCK ((lfs_block_t)-1)
+
+// littlefs calls of one type, sizes in bytes and latencies in ns
+struct call_stats
+{
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t time;
+    uint64_t sizes[SIZE_BUCKETS];
+    uint64_t latencies[LATENCY_BUCKETS];
+};
+
+typedef enum {
+    PHASE_FORMAT = 0,
+    PHASE_MOUNT,
+    PHASE_FILES,
+    PHASE_UNMOUNT,
+    PHASE_COUNT
+} phase_t;
+
 struct context
 {
-    FILE *file;
+    struct bd *bd;
+    // the write-back cache on top of the backend, NULL without one
+    const struct bd *cache;
+    // the sparse backend under the cache, NULL for raw images
+    const struct bd *sparse;
+    const char *image;
+    bool write;
+    bool discarded;
+    vfs_lfs_sync_t sync;
+    bool trim;
+    // blocks up to the highest one in use, 0 until known
+    lfs_block_t used;
+    // blocks known to hold only 0xFF, NULL when nothing is known about the image
+    uint32_t *erased;
+    // lazy fill: blocks that exist on disk, NULL when the whole image does
+    uint32_t *touched;
+    uint32_t erase_count;
+    uint32_t erase_elided;
+    bool dry_run;
+    // the file being written or closed, and whether littlefs is inside lfs_file_write()
+    const lfs_file_t *file;
+    bool file_write;
+    // file data laid out so far, an extent is a run of consecutive blocks of one file
+    uint32_t data_files;
+    uint32_t data_blocks;
+    uint32_t data_extents;
+    lfs_block_t data_last;
+    // simulated device time in ns, in total and per phase
+    struct vfs_lfs_timing timing;
+    uint64_t device_time;
+    uint64_t phase_start;
+    uint64_t phase_time[PHASE_COUNT];
+    // records every block device call when set
+    struct trace *trace;
+    vfs_lfs_stats_t stats_format;
+    // JSON stats, opened up front so that a bad path fails before the build
+    FILE *stats_file;
+    struct call_stats stats[CALL_TYPES];
 };
 
 static int fs_read(const struct lfs_config *c, lfs_block_t block,
@@ -52,74 +127,437 @@ static struct lfs_config m_lfs_config = {
     .prog_size = IO_SIZE,
     .block_size = BLOCK_SIZE,
     .cache_size = IO_SIZE,
-    .lookahead_size = IO_SIZE,
     .block_cycles = -1,
 };
 
 static struct context m_context = {0};
 
-static int fs_read(const struct lfs_config *c, lfs_block_t block,
-                   lfs_off_t off, void *buffer, lfs_size_t size)
+static bool is_erased(const struct context *context, lfs_block_t block)
 {
-    int result = 0;
-    struct context *context = c->context;
+    return context->erased != NULL && bitmap_test(context->erased, block);
+}
+
+static bool is_touched(const struct context *context, lfs_block_t block)
+{
+    return context->touched == NULL || bitmap_test(context->touched, block);
+}
+
+// File writes program nothing but data, closing a file adds a metadata commit next to its last block.
+static bool is_data(const struct context *context, lfs_block_t block)
+{
+    return context->file != NULL && (context->file_write || block == context->file->block);
+}
+
+static uint64_t wall_time(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Bucket k counts values in [2^(k-1), 2^k), 0 has a bucket of its own and the last one takes everything above.
+static unsigned log2_bucket(uint64_t value, unsigned buckets)
+{
+    unsigned bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    return bucket < buckets ? bucket : buckets - 1;
+}
+
+static bool timing_enabled(const struct vfs_lfs_timing *timing)
+{
+    return timing->read_byte_ns != 0 || timing->prog_page_ns != 0 || timing->erase_block_ns != 0;
+}
+
+// Closes the running phase, whatever the device did since the previous call is charged to it.
+static void phase_end(struct context *context, phase_t phase)
+{
+    context->phase_time[phase] += context->device_time - context->phase_start;
+    context->phase_start = context->device_time;
+}
+
+static void report_timing(const struct context *context)
+{
+    static const char *names[PHASE_COUNT] = {"format", "mount", "files", "unmount"};
+
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        INFO("timing: %-8s %12.3f ms", names[phase], context->phase_time[phase] / 1e6);
+    }
+    INFO("timing: %-8s %12.3f ms", "total", context->device_time / 1e6);
+}
+
+static int image_read(struct context *context, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    // past the end of a trimmed image
+    if (is_erased(context, block) || block >= context->bd->block_count) {
+        memset(buffer, 0xFF, size);
+        return 0;
+    }
+
+    return context->bd->read(context->bd, block, off, buffer, size);
+}
+
+static int image_prog(struct context *context, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+    // the rest of a block programmed for the first time must read back as erased
+    if (!is_touched(context, block)) {
+        int err = context->bd->erase(context->bd, block);
+        if (err != 0) {
+            return err;
+        }
+        bitmap_set(context->touched, block);
+    }
+
+    if (context->erased != NULL) {
+        bitmap_clear(context->erased, block);
+    }
+
+    if (is_data(context, block) && block != context->data_last) {
+        context->data_files += context->data_last == NO_BLOCK;
+        context->data_blocks++;
+        context->data_extents += block != context->data_last + 1;
+        context->data_last = block;
+
+        if (context->dry_run) {
+            bd_null_mark_data(context->bd, block);
+        }
+    }
+
+    return context->bd->prog(context->bd, block, off, buffer, size);
+}
+
+static int image_erase(struct context *context, lfs_block_t block)
+{
+    context->erase_count++;
+
+    if (is_erased(context, block)) {
+        context->erase_elided++;
+        return 0;
+    }
+
+    int err = context->bd->erase(context->bd, block);
+    if (err != 0) {
+        return err;
+    }
+
+    if (context->erased != NULL) {
+        bitmap_set(context->erased, block);
+    }
+    if (context->touched != NULL) {
+        bitmap_set(context->touched, block);
+    }
+    return 0;
+}
+
+static int image_sync(struct context *context)
+{
+    switch (context->sync) {
+        case VFS_LFS_SYNC_COMMIT:
+            return context->bd->sync(context->bd, BD_SYNC_DATA);
+        case VFS_LFS_SYNC_PARANOID:
+            return context->bd->sync(context->bd, BD_SYNC_FULL);
+        default:
+            // reads are served from whatever the backend buffers, the image is written out on unmount
+            return 0;
+    }
+}
+
+// Traces a littlefs call and charges it to the timing model, start is taken for the statistics.
+static int call_begin(struct context *context, trace_op_t op, lfs_block_t block, lfs_off_t off, lfs_size_t size,
+                      uint64_t *start)
+{
+    switch (op) {
+        case TRACE_OP_READ:
+            context->device_time += context->timing.read_byte_ns * size;
+            break;
+        case TRACE_OP_PROG:
+            context->device_time +=
+                context->timing.prog_page_ns * ((size + m_lfs_config.prog_size - 1) / m_lfs_config.prog_size);
+            break;
+        case TRACE_OP_ERASE:
+            // blocks known to be erased still cost an erase on the device
+            context->device_time += context->timing.erase_block_ns;
+            break;
+        case TRACE_OP_SYNC:
+            break;
+    }
 
-    size_t offset = c->block_size * block + off;
+    *start = context->stats_format != VFS_LFS_STATS_NONE ? wall_time() : 0;
 
-    int err = fseek(context->file, offset, SEEK_SET);
-    CHECK_ERROR(err == 0, -1, "fseek() failed: %d", err);
+    return context->trace != NULL ? trace_write(context->trace, op, block, off, size) : 0;
+}
+
+static void call_end(struct context *context, trace_op_t op, lfs_size_t size, uint64_t start)
+{
+    if (context->stats_format == VFS_LFS_STATS_NONE) {
+        return;
+    }
+
+    uint64_t time = wall_time() - start;
+    struct call_stats *stats = &context->stats[op];
+    stats->calls++;
+    stats->bytes += size;
+    stats->time += time;
+    stats->sizes[log2_bucket(size, SIZE_BUCKETS)]++;
+    stats->latencies[log2_bucket(time, LATENCY_BUCKETS)]++;
+}
+
+static const char *m_call_names[CALL_TYPES] = {"read", "prog", "erase", "sync"};
+
+// Histogram buckets in use, the empty ones at the top are left out.
+static unsigned used_buckets(const uint64_t *histogram, unsigned buckets)
+{
+    while (buckets > 0 && histogram[buckets - 1] == 0) {
+        buckets--;
+    }
+    return buckets;
+}
+
+static void report_histogram(const char *call, const char *name, const char *unit, const uint64_t *histogram,
+                             unsigned buckets)
+{
+    for (unsigned bucket = 0; bucket < used_buckets(histogram, buckets); bucket++) {
+        if (histogram[bucket] != 0) {
+            uint64_t low = bucket == 0 ? 0 : UINT64_C(1) << (bucket - 1);
+            INFO("stats: %-5s %s >= %llu %s: %llu", call, name, (unsigned long long)low, unit,
+                 (unsigned long long)histogram[bucket]);
+        }
+    }
+}
+
+static void print_json_histogram(FILE *file, const char *name, const uint64_t *histogram, unsigned buckets)
+{
+    fprintf(file, "\"%s\": [", name);
+    for (unsigned bucket = 0; bucket < used_buckets(histogram, buckets); bucket++) {
+        fprintf(file, "%s%llu", bucket == 0 ? "" : ", ", (unsigned long long)histogram[bucket]);
+    }
+    fprintf(file, "]");
+}
 
-    size_t bytes = fread(buffer, 1, size, context->file);
-    CHECK_ERROR(bytes == size, -1, "fread() failed: off: %u, size: %u, bytes: %u", off, size, bytes);
+// The share of steps from one data block of a file to the next that leave the run, 0 is fully contiguous.
+static double fragmentation(const struct context *context)
+{
+    uint32_t steps = context->data_blocks - context->data_files;
+    return steps != 0 ? (double)(context->data_extents - context->data_files) / steps : 0.0;
+}
 
-    //INFO("read block: %u, off: %u", block, off);
-    //INFO("read offset: %u, size: %u", offset, size);
+static int write_json_stats(struct context *context)
+{
+    int result = 0;
+
+    FILE *file = context->stats_file;
+    context->stats_file = NULL;
+
+    // histogram entry k counts values in [2^(k-1), 2^k), entry 0 counts zeroes
+    fprintf(file, "{");
+    for (int call = 0; call < CALL_TYPES; call++) {
+        const struct call_stats *stats = &context->stats[call];
+        fprintf(file, "%s\"%s\": {\"calls\": %llu, \"bytes\": %llu, \"time_ns\": %llu, ", call == 0 ? "" : ", ",
+                m_call_names[call], (unsigned long long)stats->calls, (unsigned long long)stats->bytes,
+                (unsigned long long)stats->time);
+        print_json_histogram(file, "size_log2", stats->sizes, SIZE_BUCKETS);
+        fprintf(file, ", ");
+        print_json_histogram(file, "latency_log2_ns", stats->latencies, LATENCY_BUCKETS);
+        if (call == TRACE_OP_ERASE) {
+            fprintf(file, ", \"elided\": %u", context->erase_elided);
+        }
+        fprintf(file, "}");
+    }
+    fprintf(file, ", \"fragmentation\": {\"files\": %u, \"blocks\": %u, \"extents\": %u, \"score\": %.4f}",
+            context->data_files, context->data_blocks, context->data_extents, fragmentation(context));
+    if (context->cache != NULL) {
+        struct bd_cache_stats cache = {0};
+        bd_cache_get_stats(context->cache, &cache);
+        fprintf(file, ", \"cache\": {\"hits\": %u, \"misses\": %u, \"writebacks\": %u, \"prefetched\": %u}", cache.hits,
+                cache.misses, cache.writebacks, cache.prefetched);
+    }
+    if (context->sparse != NULL && context->write) {
+        struct bd_sparse_stats sparse = {0};
+        bd_sparse_get_stats(context->sparse, &sparse);
+        fprintf(file, ", \"sparse\": {\"raw\": %u, \"fill\": %u}", sparse.raw, sparse.fill);
+    }
+    fprintf(file, "}\n");
+
+    int err = fclose(file);
+    CHECK_ERROR(err == 0, -1, "fclose() failed: %s", strerror(errno));
 
 done:
     return result;
 }
 
+static int report_stats(struct context *context)
+{
+    if (context->stats_format == VFS_LFS_STATS_TEXT) {
+        for (int call = 0; call < CALL_TYPES; call++) {
+            const struct call_stats *stats = &context->stats[call];
+            INFO("stats: %-5s %llu calls, %llu bytes, %.3f ms", m_call_names[call], (unsigned long long)stats->calls,
+                 (unsigned long long)stats->bytes, stats->time / 1e6);
+            report_histogram(m_call_names[call], "size", "B", stats->sizes, SIZE_BUCKETS);
+            report_histogram(m_call_names[call], "latency", "ns", stats->latencies, LATENCY_BUCKETS);
+        }
+        INFO("stats: erase %u requested, %u elided", context->erase_count, context->erase_elided);
+        if (context->data_files != 0) {
+            INFO("stats: fragmentation %u files, %u blocks in %u extents, score %.4f", context->data_files,
+                 context->data_blocks, context->data_extents, fragmentation(context));
+        }
+        if (context->cache != NULL) {
+            struct bd_cache_stats cache = {0};
+            bd_cache_get_stats(context->cache, &cache);
+            INFO("stats: cache %u hits, %u misses, %u write backs, %u prefetched", cache.hits, cache.misses,
+                 cache.writebacks, cache.prefetched);
+        }
+        if (context->sparse != NULL && context->write) {
+            struct bd_sparse_stats sparse = {0};
+            bd_sparse_get_stats(context->sparse, &sparse);
+            INFO("stats: sparse %u raw chunks, %u fill chunks", sparse.raw, sparse.fill);
+        }
+    } else if (context->stats_format == VFS_LFS_STATS_JSON) {
+        return write_json_stats(context);
+    }
+
+    return 0;
+}
+
+static int fs_read(const struct lfs_config *c, lfs_block_t block,
+                   lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    struct context *context = c->context;
+
+    uint64_t start = 0;
+    int err = call_begin(context, TRACE_OP_READ, block, off, size, &start);
+    if (err == 0) {
+        err = image_read(context, block, off, buffer, size);
+    }
+    call_end(context, TRACE_OP_READ, size, start);
+    return err;
+}
+
 static int fs_prog(const struct lfs_config *c, lfs_block_t block,
                    lfs_off_t off, const void *buffer, lfs_size_t size)
 {
-    int result = 0;
     struct context *context = c->context;
 
-    size_t offset = c->block_size * block + off;
+    uint64_t start = 0;
+    int err = call_begin(context, TRACE_OP_PROG, block, off, size, &start);
+    if (err == 0) {
+        err = image_prog(context, block, off, buffer, size);
+    }
+    call_end(context, TRACE_OP_PROG, size, start);
+    return err;
+}
 
-    int err = fseek(context->file, offset, SEEK_SET);
-    CHECK_ERROR(err == 0, -1, "fseek() failed: %d", err);
+static int fs_erase(const struct lfs_config *c, lfs_block_t block)
+{
+    struct context *context = c->context;
+
+    uint64_t start = 0;
+    int err = call_begin(context, TRACE_OP_ERASE, block, 0, 0, &start);
+    if (err == 0) {
+        err = image_erase(context, block);
+    }
+    call_end(context, TRACE_OP_ERASE, c->block_size, start);
+    return err;
+}
+
+static int fs_sync(const struct lfs_config *c)
+{
+    struct context *context = c->context;
+
+    uint64_t start = 0;
+    int err = call_begin(context, TRACE_OP_SYNC, 0, 0, 0, &start);
+    if (err == 0) {
+        err = image_sync(context);
+    }
+    call_end(context, TRACE_OP_SYNC, 0, start);
+    return err;
+}
 
-    size_t bytes = fwrite(buffer, 1, size, context->file);
-    CHECK_ERROR(bytes == size, -1, "fwrite() failed");
+static int used_end(void *data, lfs_block_t block)
+{
+    lfs_block_t *end = data;
+    *end = block + 1 > *end ? block + 1 : *end;
+    return 0;
+}
+
+struct usage
+{
+    lfs_block_t end;
+    lfs_block_t used;
+    lfs_block_t data;
+};
+
+static int count_usage(void *data, lfs_block_t block)
+{
+    struct usage *usage = data;
+    used_end(&usage->end, block);
+    usage->used++;
+    usage->data += bd_null_is_data(m_context.bd, block);
+    return 0;
+}
+
+static int report_usage(lfs_t *lfs)
+{
+    int result = 0;
+
+    struct usage usage = {0};
+    int err = lfs_fs_traverse(lfs, count_usage, &usage);
+    CHECK_ERROR(err == 0, -1, "lfs_fs_traverse() failed: %d", err);
+
+    INFO("dry run: %u of %u blocks needed, %llu bytes", usage.end, m_lfs_config.block_count,
+         (unsigned long long)usage.end * m_lfs_config.block_size);
+    INFO("dry run: %u blocks in use, %u data, %u metadata", usage.used, usage.data, usage.used - usage.data);
+    INFO("dry run: %u metadata compactions", bd_null_compactions(m_context.bd));
 
 done:
     return result;
 }
 
-static int fs_erase(const struct lfs_config *c, lfs_block_t block)
+static int trim_image(struct context *context)
 {
     int result = 0;
-    struct context *context = c->context;
 
-    size_t offset = c->block_size * block;
+    int fd = -1;
+
+    struct stat stat_ = {0};
+    int err = stat(context->image, &stat_);
+    CHECK_ERROR(err == 0, -1, "stat(%s) failed: %s", context->image, strerror(errno));
+
+    if (!S_ISREG(stat_.st_mode)) {
+        INFO("image is not a regular file, not trimmed");
+        goto done;
+    }
+
+    fd = open(context->image, O_WRONLY);
+    CHECK_ERROR(fd >= 0, -1, "open(%s) failed: %s", context->image, strerror(errno));
 
-    int err = fseek(context->file, offset, SEEK_SET);
-    CHECK_ERROR(err == 0, -1, "fseek() failed: %d", err);
+    err = ftruncate(fd, (off_t)context->used * m_lfs_config.block_size);
+    CHECK_ERROR(err == 0, -1, "ftruncate() failed: %s", strerror(errno));
 
-    for (size_t i = 0; i < c->block_size; i++) {
-        int c = fputc(0xFF, context->file);
-        CHECK_ERROR(c == 0xff, -1, "fputc() failed: %d", c);
+    if (context->sync != VFS_LFS_SYNC_NONE) {
+        err = sync_fd(fd, context->sync == VFS_LFS_SYNC_PARANOID);
+        CHECK_ERROR(err == 0, -1, "sync_fd() failed: %s", strerror(errno));
     }
 
+    INFO("trim: %u of %u blocks kept", context->used, m_lfs_config.block_count);
+
 done:
+    if (fd >= 0) {
+        close(fd);
+    }
     return result;
 }
 
-static int fs_sync(const struct lfs_config *c)
+static int sync_image(struct context *context)
 {
-    struct context *context = c->context;
-    return fflush(context->file) != EOF ? 0 : -1;
+    int result = 0;
+
+    if (context->sync == VFS_LFS_SYNC_NONE) {
+        goto done;
+    }
+
+    int err = context->bd->sync(context->bd, context->sync == VFS_LFS_SYNC_PARANOID ? BD_SYNC_FULL : BD_SYNC_DATA);
+    CHECK_ERROR(err == 0, -1, "bd->sync() failed: %d", err);
+
+done:
+    return result;
 }
 
 static void *vfs_open(struct vfs *vfs, const char *pathname, int flags)
@@ -180,7 +618,10 @@ static int vfs_close(struct vfs *vfs, void *fd)
     lfs_t *lfs = vfs->opaque;
     file = fd;
 
+    m_context.file = file;
     int err = lfs_file_close(lfs, file);
+    m_context.file = NULL;
+    m_context.data_last = NO_BLOCK;
     CHECK_ERROR(err == 0, -1, "lfs_file_close() failed: %d", err);
 
     free(file);
@@ -189,9 +630,9 @@ done:
     return result;
 }
 
-static int32_t vfs_read(struct vfs *vfs, void *fd, void *buf, size_t count)
+static ssize_t vfs_read(struct vfs *vfs, void *fd, void *buf, size_t count)
 {
-    int32_t result = 0;
+    ssize_t result = 0;
 
     CHECK_ERROR(vfs != NULL, -1, "vfs == NULL");
     CHECK_ERROR(fd != NULL, -1, "fd == NULL");
@@ -200,16 +641,17 @@ static int32_t vfs_read(struct vfs *vfs, void *fd, void *buf, size_t count)
     lfs_t *lfs = vfs->opaque;
     lfs_file_t *file = fd;
 
-    result = lfs_file_read(lfs, file, buf, count);
-    CHECK_ERROR(result >= 0, -1, "lfs_file_read() failed: %d", result);
+    // littlefs sizes are 32-bit, larger requests come back short
+    result = lfs_file_read(lfs, file, buf, count < LFS_FILE_MAX ? count : LFS_FILE_MAX);
+    CHECK_ERROR(result >= 0, -1, "lfs_file_read() failed: %zd", result);
 
 done:
     return result;
 }
 
-static int32_t vfs_write(struct vfs *vfs, void *fd, const void *buf, size_t count)
+static ssize_t vfs_write(struct vfs *vfs, void *fd, const void *buf, size_t count)
 {
-    int32_t result = 0;
+    ssize_t result = 0;
 
     CHECK_ERROR(vfs != NULL, -1, "vfs == NULL");
     CHECK_ERROR(fd != NULL, -1, "fd == NULL");
@@ -218,8 +660,12 @@ static int32_t vfs_write(struct vfs *vfs, void *fd, const void *buf, size_t coun
     lfs_t *lfs = vfs->opaque;
     lfs_file_t *file = fd;
 
-    result = lfs_file_write(lfs, file, buf, count);
-    CHECK_ERROR(result >= 0, -1, "lfs_file_write() failed: %d", result);
+    m_context.file = file;
+    m_context.file_write = true;
+    result = lfs_file_write(lfs, file, buf, count < LFS_FILE_MAX ? count : LFS_FILE_MAX);
+    m_context.file = NULL;
+    m_context.file_write = false;
+    CHECK_ERROR(result >= 0, -1, "lfs_file_write() failed: %zd", result);
 
 done:
     return result;
@@ -236,12 +682,20 @@ static int vfs_mount(struct vfs *vfs)
     lfs = malloc(sizeof(*lfs));
     CHECK_ERROR(lfs != NULL, -1, "malloc() failed");
 
+    phase_end(&m_context, PHASE_FORMAT);
     result = lfs_mount(lfs, &m_lfs_config);
     CHECK_ERROR(result == 0, -1, "lfs_mount() failed: %d", result);
+    phase_end(&m_context, PHASE_MOUNT);
+
+    if (m_context.trim || m_context.dry_run) {
+        // mount starts the allocator at a pseudo-random block, fill the image from the front instead
+        lfs->free.off = 0;
+    }
 
 done:
     if (result != 0) {
         free(lfs);
+        lfs = NULL;
     }
     if (vfs != NULL) {
         vfs->opaque = lfs;
@@ -249,6 +703,8 @@ done:
     return result;
 }
 
+static int close_image(int result);
+
 static int vfs_unmount(struct vfs *vfs)
 {
     int result = 0;
@@ -257,12 +713,94 @@ static int vfs_unmount(struct vfs *vfs)
 
     lfs_t *lfs = vfs->opaque;
 
+    if (lfs == NULL) {
+        goto done;
+    }
+
+    phase_end(&m_context, PHASE_FILES);
+
+    // the traversals below serve the tool, not the device
+    uint64_t device_time = m_context.device_time;
+
+    if (m_context.trim) {
+        result = lfs_fs_traverse(lfs, used_end, &m_context.used);
+        CHECK_ERROR(result == 0, -1, "lfs_fs_traverse() failed: %d", result);
+    }
+
+    if (m_context.dry_run && !m_context.discarded) {
+        result = report_usage(lfs);
+        CHECK_ERROR(result == 0, -1, "report_usage() failed: %d", result);
+    }
+
+    m_context.device_time = device_time;
+
     result = lfs_unmount(lfs);
     CHECK_ERROR(result == 0, -1, "lfs_unmount() failed: %d", result);
+    phase_end(&m_context, PHASE_UNMOUNT);
+
+    if (timing_enabled(&m_context.timing)) {
+        report_timing(&m_context);
+    }
 
     free(vfs->opaque);
+    vfs->opaque = NULL;
 
 done:
+    return close_image(result);
+}
+
+// Writes out and closes the image, result is what the caller has so far and decides whether it is kept.
+static int close_image(int result)
+{
+    if (m_context.trace != NULL) {
+        int err = trace_close(m_context.trace);
+        if (err != 0) {
+            ERROR("trace_close() failed: %d", err);
+            result = -1;
+        }
+        m_context.trace = NULL;
+    }
+    if (m_context.bd != NULL && m_context.write && !m_context.discarded && !m_context.dry_run && result == 0) {
+        int err = sync_image(&m_context);
+        if (err != 0) {
+            ERROR("sync_image() failed: %d", err);
+            result = -1;
+        }
+    }
+    if (m_context.bd != NULL) {
+        int err = m_context.bd->close(m_context.bd);
+        if (err != 0) {
+            ERROR("bd->close() failed: %d", err);
+            result = -1;
+        }
+        m_context.bd = NULL;
+    }
+    // after the close, which writes back what the cache still holds
+    if (report_stats(&m_context) != 0) {
+        ERROR("report_stats() failed");
+        result = -1;
+    }
+    m_context.stats_format = VFS_LFS_STATS_NONE;
+    if (m_context.write && !m_context.discarded && result == 0 && m_context.used != 0) {
+        int err = trim_image(&m_context);
+        if (err != 0) {
+            ERROR("trim_image() failed: %d", err);
+            result = -1;
+        }
+    }
+    // the ram and sparse backends rename the image into place on close
+    if (m_context.write && !m_context.discarded && !m_context.dry_run && result == 0 &&
+        m_context.sync == VFS_LFS_SYNC_PARANOID && !is_stream(m_context.image)) {
+        int err = sync_dir(m_context.image);
+        if (err != 0) {
+            ERROR("sync_dir() failed: %d", err);
+            result = -1;
+        }
+    }
+    free(m_context.erased);
+    m_context.erased = NULL;
+    free(m_context.touched);
+    m_context.touched = NULL;
     return result;
 }
 
@@ -376,43 +914,373 @@ static struct vfs vfs_lfs = {
     .mkdir = vfs_mkdir
 };
 
-struct vfs *vfs_lfs_get(const char *image, bool write, size_t name_max, size_t io_size, size_t block_size,
-                        size_t block_count)
+static struct bd *bd_open_backend(const struct vfs_lfs_options *options, size_t block_count)
 {
-    struct vfs *result = NULL;
+    size_t block_size = m_lfs_config.block_size;
+    bd_mode_t mode = !options->write ? BD_MODE_READ : options->in_place ? BD_MODE_UPDATE : BD_MODE_CREATE;
+
+    // sparse and streamed images are assembled in memory
+    if (options->format == VFS_LFS_FORMAT_SPARSE || is_stream(options->image)) {
+        bool sparse = options->format == VFS_LFS_FORMAT_SPARSE;
+        struct bd *bd = sparse ? bd_sparse_get(options->image, mode, options->offset, block_size, block_count)
+                               : bd_ram_get(options->image, mode, options->offset, block_size, block_count,
+                                            options->pages);
+        // only after the open, which takes stdout away from messages when the image is streamed to it
+        if (bd != NULL && options->backend != BD_TYPE_DEFAULT && (sparse || options->backend != BD_TYPE_RAM)) {
+            INFO("the image is buffered in memory, the backend setting is ignored");
+        }
+        return bd;
+    }
+
+    switch (options->backend) {
+        case BD_TYPE_STDIO:
+            return bd_stdio_get(options->image, mode, options->offset, block_size, block_count);
+        case BD_TYPE_FILE:
+            return bd_file_get(options->image, mode, options->offset, block_size, block_count);
+        case BD_TYPE_MMAP:
+            return bd_mmap_get(options->image, mode, options->offset, block_size, block_count);
+        case BD_TYPE_RAM:
+            return bd_ram_get(options->image, mode, options->offset, block_size, block_count, options->pages);
+        case BD_TYPE_DIRECT: {
+            struct bd *bd = bd_direct_get(options->image, mode, options->offset, block_size, block_count);
+            if (bd == NULL) {
+                INFO("direct I/O is not available, falling back to positional I/O");
+                bd = bd_file_get(options->image, mode, options->offset, block_size, block_count);
+            }
+            return bd;
+        }
+        case BD_TYPE_URING: {
+            struct bd *bd = bd_uring_get(options->image, mode, options->offset, block_size, block_count);
+            if (bd == NULL) {
+                INFO("io_uring is not available, falling back to positional I/O");
+                bd = bd_file_get(options->image, mode, options->offset, block_size, block_count);
+            }
+            return bd;
+        }
+        case BD_TYPE_DEFAULT:
+        /* FALLTHROUGH */
+        default: {
+#ifndef _WIN32
+            struct bd *bd = bd_mmap_get(options->image, mode, options->offset, block_size, block_count);
+            if (bd == NULL) {
+                INFO("mmap is not available, falling back to positional I/O");
+                bd = bd_file_get(options->image, mode, options->offset, block_size, block_count);
+            }
+            return bd;
+#else
+            return bd_stdio_get(options->image, mode, options->offset, block_size, block_count);
+#endif //_WIN32
+        }
+    }
+}
 
-    m_context.file = fopen(image, write ? "w+b" : "rb");
-    CHECK_ERROR(m_context.file != NULL, NULL, "fopen() failed: %s", strerror(errno));
+static struct bd *bd_open(const struct vfs_lfs_options *options)
+{
+    struct bd *result = NULL;
+
+    size_t block_count = m_lfs_config.block_count;
+
+    if (options->dry_run) {
+        return bd_null_get(m_lfs_config.block_size, block_count);
+    }
+
+    uint64_t end = options->offset + (uint64_t)block_count * m_lfs_config.block_size;
+
+    struct stat stat_ = {0};
+    bool regular = stat(options->image, &stat_) == 0 && S_ISREG(stat_.st_mode);
+
+    if (options->write && options->in_place) {
+        CHECK_ERROR(!regular || (uint64_t)stat_.st_size >= end, NULL, "partition runs past the end of the image: %llu > %lld",
+                    (unsigned long long)end, (long long)stat_.st_size);
+    }
+
+    // a trimmed image ends early, the blocks it lacks read as erased
+    if (!options->write && options->format == VFS_LFS_FORMAT_RAW && regular && (uint64_t)stat_.st_size < end) {
+        uint64_t size = (uint64_t)stat_.st_size > options->offset ? stat_.st_size - options->offset : 0;
+        block_count = size / m_lfs_config.block_size;
+        INFO("image holds %zu of %u blocks, the rest reads as erased", block_count, m_lfs_config.block_count);
+    }
+
+    struct bd *bd = bd_open_backend(options, block_count);
+    CHECK_ERROR(bd != NULL, NULL, "bd_open_backend() failed");
+    if (options->format == VFS_LFS_FORMAT_SPARSE) {
+        m_context.sparse = bd;
+    }
+
+    size_t cache_budget = options->cache_budget;
+    if (options->readahead != 0 && cache_budget == 0) {
+        // two windows plus room for the blocks littlefs walks through between data blocks
+        cache_budget = (2 * options->readahead + 32) * bd->block_size;
+    }
+
+    if (cache_budget != 0) {
+        struct bd *cache = bd_cache_get(bd, cache_budget, options->readahead);
+        if (cache == NULL) {
+            bd->close(bd);
+        }
+        bd = cache;
+        CHECK_ERROR(bd != NULL, NULL, "bd_cache_get() failed");
+        m_context.cache = cache;
+    }
+
+    result = bd;
+
+done:
+    return result;
+}
+
+// Opens the image and gets it ready for littlefs, a new one is formatted unless format is false.
+static int open_image(const struct vfs_lfs_options *options, bool format)
+{
+    int result = 0;
+
+    CHECK_ERROR(options != NULL, -1, "options == NULL");
+    CHECK_ERROR(options->image != NULL || options->dry_run, -1, "options->image == NULL");
+    CHECK_ERROR(options->write || !options->dry_run, -1, "a dry run only builds images");
 
     m_lfs_config.context = &m_context;
 
-    if (io_size != 0) {
-        m_lfs_config.read_size = io_size;
-        m_lfs_config.prog_size = io_size;
-        m_lfs_config.cache_size = io_size;
-        m_lfs_config.lookahead_size = io_size;
+    if (options->io_size != 0) {
+        m_lfs_config.read_size = options->io_size;
+        m_lfs_config.prog_size = options->io_size;
+        m_lfs_config.cache_size = options->io_size;
+    }
+
+    if (options->block_size != 0) {
+        m_lfs_config.block_size = options->block_size;
+    }
+
+    m_lfs_config.block_count = options->block_count != 0 ? options->block_count : 4059;
+
+    if (options->length != 0) {
+        bool whole = options->length / m_lfs_config.block_size * m_lfs_config.block_size == options->length;
+        CHECK_ERROR(whole, -1, "partition length %llu is not a multiple of the block size",
+                    (unsigned long long)options->length);
+        CHECK_ERROR(options->block_count == 0 || (uint64_t)options->block_count * m_lfs_config.block_size == options->length,
+                    -1, "partition length and block count disagree");
+        CHECK_ERROR(options->length / m_lfs_config.block_size <= UINT32_MAX, -1, "partition has too many blocks");
+        m_lfs_config.block_count = options->length / m_lfs_config.block_size;
     }
+    m_lfs_config.name_max = options->name_max;
+
+    // one lookahead window over the whole device, so littlefs only walks the tree again after allocating its way
+    // around it instead of every 8 * io_size blocks
+    m_lfs_config.lookahead_size = (m_lfs_config.block_count / 64 + 1) * 8;
+    m_lfs_config.alloc = options->alloc == VFS_LFS_ALLOC_CONTIGUOUS ? alloc_contiguous : NULL;
+
+    CHECK_ERROR(!is_stream(options->image) || !options->in_place, -1, "a streamed image cannot be updated in place");
+
+    m_context.cache = NULL;
+    m_context.sparse = NULL;
+    m_context.bd = bd_open(options);
+    CHECK_ERROR(m_context.bd != NULL, -1, "bd_open() failed");
+
+    m_context.image = options->image;
+    m_context.write = options->write;
+    m_context.discarded = false;
+    m_context.sync = options->sync;
+    m_context.trim = options->write && options->trim && options->format == VFS_LFS_FORMAT_RAW && !options->in_place &&
+                     !is_stream(options->image) && !options->dry_run;
+    m_context.used = 0;
+    m_context.dry_run = options->dry_run;
+    m_context.file = NULL;
+    m_context.file_write = false;
+    m_context.data_files = 0;
+    m_context.data_blocks = 0;
+    m_context.data_extents = 0;
+    m_context.data_last = NO_BLOCK;
+    m_context.timing = options->timing;
+    m_context.trace = NULL;
+    m_context.stats_format = options->stats;
+    m_context.stats_file = NULL;
+    memset(m_context.stats, 0, sizeof(m_context.stats));
+    m_context.device_time = 0;
+    m_context.phase_start = 0;
+    memset(m_context.phase_time, 0, sizeof(m_context.phase_time));
+
+    if (options->dry_run && options->image != NULL) {
+        INFO("dry run, %s is left alone", options->image);
+    } else if (options->trim && options->format == VFS_LFS_FORMAT_SPARSE) {
+        INFO("sparse images leave out erased blocks already, not trimmed");
+    } else if (options->trim && options->in_place) {
+        INFO("the partition is written in place, not trimmed");
+    } else if (options->trim && is_stream(options->image)) {
+        INFO("streamed images are not trimmed");
+    }
+    m_context.erase_count = 0;
+    m_context.erase_elided = 0;
 
-    if (block_size != 0) {
-        m_lfs_config.block_size = block_size;
+    if (options->write && options->sync == VFS_LFS_SYNC_PARANOID && !is_stream(options->image) && !options->dry_run) {
+        int err = sync_dir(options->image);
+        CHECK_ERROR(err == 0, -1, "sync_dir() failed: %d", err);
     }
 
-    m_lfs_config.block_count = block_count != 0 ? block_count : 4059;
-    m_lfs_config.name_max = name_max;
+    if (options->write) {
+        // every block of a new image starts out erased, on disk or virtually
+        m_context.erased = bitmap_alloc(m_lfs_config.block_count, true);
+        CHECK_ERROR(m_context.erased != NULL, -1, "bitmap_alloc() failed");
+    }
 
-    if (write) {
-        for (size_t i = 0; i < m_lfs_config.block_count * m_lfs_config.block_size; i++) {
-            int c = fputc(0xff, m_context.file);
-            CHECK_ERROR(c == 0xFF, NULL, "fputc() failed: %d", c);
+    if (options->write && options->fill == VFS_LFS_FILL_LAZY) {
+        m_context.touched = bitmap_alloc(m_lfs_config.block_count, false);
+        CHECK_ERROR(m_context.touched != NULL, -1, "bitmap_alloc() failed");
+    } else if (options->write && m_context.bd->fill != NULL) {
+        int err = m_context.bd->fill(m_context.bd);
+        CHECK_ERROR(err == 0, -1, "bd->fill() failed: %d", err);
+    } else if (options->write) {
+        for (lfs_block_t block = 0; block < m_lfs_config.block_count; block++) {
+            int err = m_context.bd->erase(m_context.bd, block);
+            CHECK_ERROR(err == 0, -1, "bd->erase() failed: %d", err);
         }
+    }
+
+    if (options->trace != NULL) {
+        struct trace_header header = {
+            .block_size = m_lfs_config.block_size,
+            .block_count = m_lfs_config.block_count,
+            .read_size = m_lfs_config.read_size,
+            .prog_size = m_lfs_config.prog_size,
+            .write = options->write,
+        };
+        m_context.trace = trace_create(options->trace, &header);
+        CHECK_ERROR(m_context.trace != NULL, -1, "trace_create() failed");
+    }
+
+    if (options->stats == VFS_LFS_STATS_JSON) {
+        CHECK_ERROR(options->stats_file != NULL, -1, "options->stats_file == NULL");
+        m_context.stats_file = fopen(options->stats_file, "w");
+        CHECK_ERROR(m_context.stats_file != NULL, -1, "fopen() failed: %s: %s", options->stats_file, strerror(errno));
+    }
 
+    if (options->write && format) {
         lfs_t lfs = {0};
         int err = lfs_format(&lfs, &m_lfs_config);
-        CHECK_ERROR(err == 0, NULL, "lfs_format() failed: %d", err);
+        CHECK_ERROR(err == 0, -1, "lfs_format() failed: %d", err);
     }
 
+done:
+    if (result != 0 && m_context.bd != NULL) {
+        if (m_context.bd->discard != NULL) {
+            m_context.bd->discard(m_context.bd);
+        }
+        m_context.bd->close(m_context.bd);
+        m_context.bd = NULL;
+    }
+    if (result != 0 && m_context.trace != NULL) {
+        trace_close(m_context.trace);
+        m_context.trace = NULL;
+    }
+    if (result != 0) {
+        free(m_context.erased);
+        m_context.erased = NULL;
+        free(m_context.touched);
+        m_context.touched = NULL;
+    }
+    return result;
+}
+
+struct vfs *vfs_lfs_get(const struct vfs_lfs_options *options)
+{
+    struct vfs *result = NULL;
+
+    int err = open_image(options, true);
+    CHECK_ERROR(err == 0, NULL, "open_image() failed: %d", err);
+
     result = &vfs_lfs;
 
 done:
     return result;
 }
+
+void vfs_lfs_discard(struct vfs *vfs)
+{
+    m_context.discarded = true;
+    if (m_context.bd != NULL && m_context.bd->discard != NULL) {
+        int err = m_context.bd->discard(m_context.bd);
+        if (err != 0) {
+            ERROR("bd->discard() failed: %d", err);
+        }
+    }
+}
+
+int vfs_lfs_replay(const struct vfs_lfs_options *options, const char *path)
+{
+    int result = 0;
+
+    struct trace *trace = NULL;
+    uint8_t *buffer = NULL;
+    uint8_t *data = NULL;
+    bool open = false;
+    uint64_t count = 0;
+    struct trace_record record = {0};
+
+    CHECK_ERROR(options != NULL, -1, "options == NULL");
+    CHECK_ERROR(path != NULL, -1, "path == NULL");
+    CHECK_ERROR(options->trace == NULL && !options->dry_run, -1, "a replay can be neither traced nor dry");
+
+    struct trace_header header = {0};
+    trace = trace_open(path, &header);
+    CHECK_ERROR(trace != NULL, -1, "trace_open() failed");
+    CHECK_ERROR(header.block_size != 0 && header.read_size == header.prog_size, -1, "unsupported trace geometry");
+
+    // the image takes the geometry of the traced one, the rest of the options choose how it is accessed
+    struct vfs_lfs_options replay = *options;
+    replay.write = header.write;
+    replay.block_size = header.block_size;
+    replay.block_count = header.block_count;
+    replay.io_size = header.prog_size;
+    replay.length = 0;
+
+    // reads land in their own buffer, so that every program writes the same filler
+    buffer = malloc(header.block_size);
+    CHECK_ERROR(buffer != NULL, -1, "malloc() failed");
+    data = malloc(header.block_size);
+    CHECK_ERROR(data != NULL, -1, "malloc() failed");
+    memset(data, 0x5A, header.block_size);
+
+    int err = open_image(&replay, false);
+    CHECK_ERROR(err == 0, -1, "open_image() failed: %d", err);
+    open = true;
+
+    uint64_t start = wall_time();
+
+    while ((err = trace_read(trace, &record)) == 1) {
+        CHECK_ERROR(record.block < header.block_count && (uint64_t)record.off + record.size <= header.block_size,
+                    -1, "record %llu is out of range", (unsigned long long)count);
+
+        switch (record.op) {
+            case TRACE_OP_READ:
+                err = m_lfs_config.read(&m_lfs_config, record.block, record.off, buffer, record.size);
+                break;
+            case TRACE_OP_PROG:
+                err = m_lfs_config.prog(&m_lfs_config, record.block, record.off, data, record.size);
+                break;
+            case TRACE_OP_ERASE:
+                err = m_lfs_config.erase(&m_lfs_config, record.block);
+                break;
+            case TRACE_OP_SYNC:
+                err = m_lfs_config.sync(&m_lfs_config);
+                break;
+        }
+        CHECK_ERROR(err == 0, -1, "record %llu failed: %d", (unsigned long long)count, err);
+        count++;
+    }
+    CHECK_ERROR(err == 0, -1, "trace_read() failed: %d", err);
+
+    INFO("replay: %llu operations in %.3f s, traced in %.3f s", (unsigned long long)count,
+         (wall_time() - start) / 1e9, record.time / 1e9);
+
+done:
+    if (open) {
+        if (result != 0) {
+            vfs_lfs_discard(NULL);
+        }
+        result = close_image(result);
+    }
+    if (trace != NULL) {
+        trace_close(trace);
+    }
+    free(buffer);
+    free(data);
+    return result;
+}
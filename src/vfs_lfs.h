@@ -16,7 +16,83 @@
 
 #include <stdbool.h>
 
+#include "bd.h"
+#include "bd_ram.h"
 #include "vfs.h"
 
-struct vfs *vfs_lfs_get(const char *image, bool write, size_t name_max, size_t io_size, size_t block_size,
-                        size_t block_count);
+typedef enum {
+    VFS_LFS_FILL_FULL = 0,
+    VFS_LFS_FILL_LAZY
+} vfs_lfs_fill_t;
+
+typedef enum {
+    VFS_LFS_FORMAT_RAW = 0,
+    VFS_LFS_FORMAT_SPARSE
+} vfs_lfs_format_t;
+
+// When littlefs commits reach stable storage, END trades crash safety during the build for throughput.
+typedef enum {
+    VFS_LFS_SYNC_END = 0, // one fdatasync on unmount
+    VFS_LFS_SYNC_NONE,    // left to the OS
+    VFS_LFS_SYNC_COMMIT,  // fdatasync on every littlefs sync
+    VFS_LFS_SYNC_PARANOID // fsync on every littlefs sync, the directory is synced too
+} vfs_lfs_sync_t;
+
+typedef enum {
+    VFS_LFS_STATS_NONE = 0,
+    VFS_LFS_STATS_TEXT,
+    VFS_LFS_STATS_JSON
+} vfs_lfs_stats_t;
+
+// Where littlefs puts file data, CONTIGUOUS keeps each file in runs of consecutive blocks.
+typedef enum {
+    VFS_LFS_ALLOC_NEXT = 0,
+    VFS_LFS_ALLOC_CONTIGUOUS
+} vfs_lfs_alloc_t;
+
+// Latencies of the target flash, charged per littlefs block device call. All zero turns the model off.
+struct vfs_lfs_timing {
+    uint64_t read_byte_ns;
+    uint64_t prog_page_ns;  // a page is one prog_size unit
+    uint64_t erase_block_ns;
+};
+
+struct vfs_lfs_options {
+    const char *image;
+    bool write;
+    size_t name_max;
+    size_t io_size;
+    size_t block_size;
+    size_t block_count;
+    bd_type_t backend;
+    bd_ram_pages_t pages;
+    vfs_lfs_format_t format;
+    // position and size of the partition inside the image, the length overrides the block count
+    uint64_t offset;
+    uint64_t length;
+    // format the partition inside an existing image and leave the rest of it alone
+    bool in_place;
+    vfs_lfs_fill_t fill;
+    vfs_lfs_sync_t sync;
+    // cut the new image after the highest block in use
+    bool trim;
+    size_t cache_budget;
+    size_t readahead;
+    // build the file system without an image and report how much of the device it needs
+    bool dry_run;
+    struct vfs_lfs_timing timing;
+    // file to record littlefs block device calls in, NULL for none
+    const char *trace;
+    // per-call counters and histograms printed when the image is closed, JSON goes to stats_file instead of stdout
+    vfs_lfs_stats_t stats;
+    const char *stats_file;
+    vfs_lfs_alloc_t alloc;
+};
+
+struct vfs *vfs_lfs_get(const struct vfs_lfs_options *options);
+
+// Runs the block device calls recorded with the trace option against the image, without littlefs on top.
+int vfs_lfs_replay(const struct vfs_lfs_options *options, const char *trace);
+
+// Marks the image as failed, backends that buffer the image will not write it on unmount.
+void vfs_lfs_discard(struct vfs *vfs);
@@ -100,32 +100,36 @@ done:
     return result;
 }
 
-static int32_t vfs_read(struct vfs *vfs, void *fd, void *buf, size_t count)
+static ssize_t vfs_read(struct vfs *vfs, void *fd, void *buf, size_t count)
 {
-    int32_t result = 0;
+    ssize_t result = 0;
 
     CHECK_ERROR(vfs != NULL, -1, "vfs == NULL");
     CHECK_ERROR(fd != NULL, -1, "fd == NULL");
     CHECK_ERROR(buf != NULL, -1, "buf == NULL");
 
     struct vfs_file *file = fd;
-    result = read(file->fd, buf, count);
+    do {
+        result = read(file->fd, buf, count);
+    } while (result < 0 && errno == EINTR);
     CHECK_ERROR(result >= 0, result, "read() failed: %s", strerror(errno));
 
 done:
     return result;
 }
 
-static int32_t vfs_write(struct vfs *vfs, void *fd, const void *buf, size_t count)
+static ssize_t vfs_write(struct vfs *vfs, void *fd, const void *buf, size_t count)
 {
-    int32_t result = 0;
+    ssize_t result = 0;
 
     CHECK_ERROR(vfs != NULL, -1, "vfs == NULL");
     CHECK_ERROR(fd != NULL, -1, "fd == NULL");
     CHECK_ERROR(buf != NULL, -1, "buf == NULL");
 
     struct vfs_file *file = fd;
-    result = write(file->fd, buf, count);
+    do {
+        result = write(file->fd, buf, count);
+    } while (result < 0 && errno == EINTR);
     CHECK_ERROR(result >= 0, result, "write() failed: %s", strerror(errno));
 
 done:
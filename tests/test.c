@@ -2,6 +2,11 @@
 
 static void RunAllTests() {
     RUN_TEST_GROUP(LfsTool);
+    RUN_TEST_GROUP(LargeImage);
+    RUN_TEST_GROUP(Crc);
+    RUN_TEST_GROUP(Alloc);
+    RUN_TEST_GROUP(Backend);
+    RUN_TEST_GROUP(Replay);
 }
 
 int main(int argc, const char **argv) {
@@ -0,0 +1,141 @@
+#include "unity_fixture.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "lfs/lfs.h"
+
+// A small device in memory whose free space is cut into holes before a large file goes in.
+#define BLOCK_SIZE 512
+#define BLOCK_COUNT 256
+#define FILLERS 180
+#define FILE_BLOCKS 40
+
+static uint8_t m_device[BLOCK_COUNT][BLOCK_SIZE];
+static uint8_t m_data[BLOCK_SIZE];
+
+// data blocks of the file being written, in the order littlefs programs them
+static bool m_recording;
+static lfs_block_t m_last;
+static unsigned m_extents;
+
+static int device_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    memcpy(buffer, &m_device[block][off], size);
+    return 0;
+}
+
+static int device_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer,
+                       lfs_size_t size)
+{
+    memcpy(&m_device[block][off], buffer, size);
+    if (m_recording && block != m_last) {
+        m_extents += block != m_last + 1;
+        m_last = block;
+    }
+    return 0;
+}
+
+static int device_erase(const struct lfs_config *c, lfs_block_t block)
+{
+    memset(m_device[block], 0xFF, BLOCK_SIZE);
+    return 0;
+}
+
+static int device_sync(const struct lfs_config *c)
+{
+    return 0;
+}
+
+// Writes the large file into a fragmented device with the given alloc hook and returns the number of extents it took.
+static unsigned write_fragmented(bool (*alloc)(struct lfs *, lfs_block_t, lfs_size_t, lfs_block_t *))
+{
+    struct lfs_config config = {
+        .read = device_read,
+        .prog = device_prog,
+        .erase = device_erase,
+        .sync = device_sync,
+        .read_size = 16,
+        .prog_size = 16,
+        .block_size = BLOCK_SIZE,
+        .block_count = BLOCK_COUNT,
+        .cache_size = 16,
+        .lookahead_size = BLOCK_COUNT / 8,
+        .block_cycles = -1,
+        .alloc = alloc,
+    };
+    lfs_t lfs;
+    lfs_file_t file;
+    char name[16];
+
+    TEST_ASSERT_EQUAL_INT(0, lfs_format(&lfs, &config));
+    TEST_ASSERT_EQUAL_INT(0, lfs_mount(&lfs, &config));
+
+    // one block files, then a long hole and a lot of single block ones
+    for (int i = 0; i < FILLERS; i++) {
+        snprintf(name, sizeof(name), "f%03d", i);
+        TEST_ASSERT_EQUAL_INT(0, lfs_file_open(&lfs, &file, name, LFS_O_WRONLY | LFS_O_CREAT));
+        TEST_ASSERT_EQUAL_INT(400, lfs_file_write(&lfs, &file, m_data, 400));
+        TEST_ASSERT_EQUAL_INT(0, lfs_file_close(&lfs, &file));
+    }
+    for (int i = 0; i < FILLERS; i++) {
+        if ((i >= 40 && i < 60) || i % 3 == 0) {
+            snprintf(name, sizeof(name), "f%03d", i);
+            TEST_ASSERT_EQUAL_INT(0, lfs_remove(&lfs, name));
+        }
+    }
+
+    // a new mount sees the holes
+    TEST_ASSERT_EQUAL_INT(0, lfs_unmount(&lfs));
+    TEST_ASSERT_EQUAL_INT(0, lfs_mount(&lfs, &config));
+
+    m_recording = true;
+    m_last = (lfs_block_t)-1;
+    m_extents = 0;
+    TEST_ASSERT_EQUAL_INT(0, lfs_file_open(&lfs, &file, "large", LFS_O_WRONLY | LFS_O_CREAT));
+    for (int i = 0; i < FILE_BLOCKS; i++) {
+        TEST_ASSERT_EQUAL_INT(BLOCK_SIZE, lfs_file_write(&lfs, &file, m_data, BLOCK_SIZE));
+    }
+    m_recording = false;
+    TEST_ASSERT_EQUAL_INT(0, lfs_file_close(&lfs, &file));
+
+    uint8_t buffer[BLOCK_SIZE];
+    TEST_ASSERT_EQUAL_INT(0, lfs_file_open(&lfs, &file, "large", LFS_O_RDONLY));
+    for (int i = 0; i < FILE_BLOCKS; i++) {
+        TEST_ASSERT_EQUAL_INT(BLOCK_SIZE, lfs_file_read(&lfs, &file, buffer, BLOCK_SIZE));
+        TEST_ASSERT_EQUAL_MEMORY(m_data, buffer, BLOCK_SIZE);
+    }
+    TEST_ASSERT_EQUAL_INT(0, lfs_file_close(&lfs, &file));
+    TEST_ASSERT_EQUAL_INT(0, lfs_unmount(&lfs));
+
+    return m_extents;
+}
+
+TEST_GROUP(Alloc);
+
+TEST_SETUP(Alloc)
+{
+    for (size_t i = 0; i < sizeof(m_data); i++) {
+        m_data[i] = i * 7;
+    }
+}
+
+TEST_TEAR_DOWN(Alloc)
+{
+}
+
+TEST(Alloc, ContiguousFileData)
+{
+    unsigned next = write_fragmented(NULL);
+    unsigned contiguous = write_fragmented(alloc_contiguous);
+
+    // the next free block walks through every hole, runs of consecutive blocks skip them
+    TEST_ASSERT_TRUE(next > 2 * contiguous);
+}
+
+TEST_GROUP_RUNNER(Alloc)
+{
+    RUN_TEST_CASE(Alloc, ContiguousFileData);
+}
@@ -0,0 +1,232 @@
+#include "unity_fixture.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vfs_lfs.h"
+
+// The same small tree goes into an image and comes back out through every block device stack.
+#define BLOCK_SIZE 4096
+#define BLOCK_COUNT 64
+#define LARGE_SIZE (12 * BLOCK_SIZE + 123)
+
+static char m_image[] = "/tmp/lfs-tool-test-XXXXXX";
+static uint8_t m_large[LARGE_SIZE];
+static const char m_small[] = "a file in a directory";
+
+static struct vfs_lfs_options options_for(bd_type_t backend)
+{
+    struct vfs_lfs_options options = {
+        .image = m_image,
+        .write = true,
+        .block_size = BLOCK_SIZE,
+        .block_count = BLOCK_COUNT,
+        .backend = backend,
+    };
+    return options;
+}
+
+static void write_file(struct vfs *vfs, const char *path, const void *data, size_t size)
+{
+    void *file = vfs->open(vfs, path, O_CREAT | O_TRUNC | O_WRONLY);
+    TEST_ASSERT_NOT_NULL(file);
+
+    // uneven pieces, so that writes straddle blocks
+    for (size_t done = 0; done < size;) {
+        size_t piece = size - done < 1000 ? size - done : 1000;
+        TEST_ASSERT_EQUAL_INT(piece, vfs->write(vfs, file, (const uint8_t *)data + done, piece));
+        done += piece;
+    }
+    TEST_ASSERT_EQUAL_INT(0, vfs->close(vfs, file));
+}
+
+static void check_file(struct vfs *vfs, const char *path, const void *data, size_t size)
+{
+    static uint8_t buffer[LARGE_SIZE + 1];
+
+    void *file = vfs->open(vfs, path, O_RDONLY);
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_INT(size, vfs->read(vfs, file, buffer, sizeof(buffer)));
+    TEST_ASSERT_EQUAL_INT(0, vfs->close(vfs, file));
+    TEST_ASSERT_EQUAL_MEMORY(data, buffer, size);
+}
+
+static void build(const struct vfs_lfs_options *options)
+{
+    struct vfs *vfs = vfs_lfs_get(options);
+    TEST_ASSERT_NOT_NULL(vfs);
+    TEST_ASSERT_EQUAL_INT(0, vfs->mount(vfs));
+    TEST_ASSERT_EQUAL_INT(0, vfs->mkdir(vfs, "/dir"));
+    write_file(vfs, "/dir/small", m_small, sizeof(m_small));
+    write_file(vfs, "/large", m_large, sizeof(m_large));
+    TEST_ASSERT_EQUAL_INT(0, vfs->unmount(vfs));
+}
+
+static void check(const struct vfs_lfs_options *options)
+{
+    struct vfs_lfs_options read = *options;
+    read.write = false;
+
+    struct vfs *vfs = vfs_lfs_get(&read);
+    TEST_ASSERT_NOT_NULL(vfs);
+    TEST_ASSERT_EQUAL_INT(0, vfs->mount(vfs));
+    check_file(vfs, "/dir/small", m_small, sizeof(m_small));
+    check_file(vfs, "/large", m_large, sizeof(m_large));
+    TEST_ASSERT_EQUAL_INT(0, vfs->unmount(vfs));
+}
+
+static void round_trip(const struct vfs_lfs_options *options)
+{
+    build(options);
+    check(options);
+}
+
+TEST_GROUP(Backend);
+
+TEST_SETUP(Backend)
+{
+    strcpy(m_image, "/tmp/lfs-tool-test-XXXXXX");
+    int fd = mkstemp(m_image);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+
+    srand(6);
+    for (size_t i = 0; i < sizeof(m_large); i++) {
+        m_large[i] = rand();
+    }
+}
+
+TEST_TEAR_DOWN(Backend)
+{
+    unlink(m_image);
+}
+
+TEST(Backend, Stdio)
+{
+    struct vfs_lfs_options options = options_for(BD_TYPE_STDIO);
+    round_trip(&options);
+}
+
+TEST(Backend, File)
+{
+    struct vfs_lfs_options options = options_for(BD_TYPE_FILE);
+    round_trip(&options);
+}
+
+TEST(Backend, Mmap)
+{
+    struct vfs_lfs_options options = options_for(BD_TYPE_MMAP);
+    round_trip(&options);
+}
+
+TEST(Backend, Ram)
+{
+    struct vfs_lfs_options options = options_for(BD_TYPE_RAM);
+    options.pages = BD_RAM_PAGES_NORMAL;
+    round_trip(&options);
+}
+
+// io_uring and O_DIRECT fall back to positional I/O where the kernel or the file system lacks them
+TEST(Backend, Uring)
+{
+    struct vfs_lfs_options options = options_for(BD_TYPE_URING);
+    round_trip(&options);
+}
+
+TEST(Backend, Direct)
+{
+    struct vfs_lfs_options options = options_for(BD_TYPE_DIRECT);
+    round_trip(&options);
+
+    options.fill = VFS_LFS_FILL_LAZY;
+    round_trip(&options);
+}
+
+TEST(Backend, Cache)
+{
+    // a budget of a few blocks forces write backs while the large file goes in
+    struct vfs_lfs_options options = options_for(BD_TYPE_FILE);
+    options.cache_budget = 4 * BLOCK_SIZE;
+    round_trip(&options);
+
+    // read-ahead picks its own budget
+    options.cache_budget = 0;
+    options.readahead = 4;
+    round_trip(&options);
+}
+
+TEST(Backend, Sparse)
+{
+    struct vfs_lfs_options options = options_for(BD_TYPE_DEFAULT);
+    options.format = VFS_LFS_FORMAT_SPARSE;
+    round_trip(&options);
+
+    // erased blocks are left out, so the image is smaller than the device
+    struct stat stat_ = {0};
+    TEST_ASSERT_EQUAL_INT(0, stat(m_image, &stat_));
+    TEST_ASSERT_TRUE(stat_.st_size < BLOCK_SIZE * BLOCK_COUNT);
+}
+
+TEST(Backend, SparseFailureKeepsTarget)
+{
+    struct vfs_lfs_options options = options_for(BD_TYPE_DEFAULT);
+    options.format = VFS_LFS_FORMAT_SPARSE;
+    build(&options);
+
+    // a discarded build must not touch the image that is already there
+    struct vfs *vfs = vfs_lfs_get(&options);
+    TEST_ASSERT_NOT_NULL(vfs);
+    TEST_ASSERT_EQUAL_INT(0, vfs->mount(vfs));
+    write_file(vfs, "/other", m_small, sizeof(m_small));
+    vfs_lfs_discard(vfs);
+    vfs->unmount(vfs);
+
+    check(&options);
+}
+
+TEST(Backend, DryRun)
+{
+    unlink(m_image);
+
+    struct vfs_lfs_options options = options_for(BD_TYPE_DEFAULT);
+    options.dry_run = true;
+    build(&options);
+
+    TEST_ASSERT_EQUAL_INT(-1, access(m_image, F_OK));
+}
+
+TEST(Backend, SyncPolicies)
+{
+    const vfs_lfs_sync_t policies[] = {
+        VFS_LFS_SYNC_END, VFS_LFS_SYNC_NONE, VFS_LFS_SYNC_COMMIT, VFS_LFS_SYNC_PARANOID
+    };
+
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        struct vfs_lfs_options options = options_for(BD_TYPE_FILE);
+        options.sync = policies[i];
+        round_trip(&options);
+
+        options.backend = BD_TYPE_RAM;
+        round_trip(&options);
+    }
+}
+
+TEST_GROUP_RUNNER(Backend)
+{
+    RUN_TEST_CASE(Backend, Stdio);
+    RUN_TEST_CASE(Backend, File);
+    RUN_TEST_CASE(Backend, Mmap);
+    RUN_TEST_CASE(Backend, Ram);
+    RUN_TEST_CASE(Backend, Uring);
+    RUN_TEST_CASE(Backend, Direct);
+    RUN_TEST_CASE(Backend, Cache);
+    RUN_TEST_CASE(Backend, Sparse);
+    RUN_TEST_CASE(Backend, SparseFailureKeepsTarget);
+    RUN_TEST_CASE(Backend, DryRun);
+    RUN_TEST_CASE(Backend, SyncPolicies);
+}
@@ -0,0 +1,74 @@
+#include "unity_fixture.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "lfs/lfs_util.h"
+
+// The nibble-table CRC littlefs ships with, lfs_crc has to match it bit for bit.
+static uint32_t reference_crc(uint32_t crc, const void *buffer, size_t size)
+{
+    static const uint32_t rtable[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    const uint8_t *data = buffer;
+
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc >> 4) ^ rtable[(crc ^ (data[i] >> 0)) & 0xf];
+        crc = (crc >> 4) ^ rtable[(crc ^ (data[i] >> 4)) & 0xf];
+    }
+
+    return crc;
+}
+
+static uint8_t m_data[4096 + 16];
+
+TEST_GROUP(Crc);
+
+TEST_SETUP(Crc)
+{
+    srand(17);
+    for (size_t i = 0; i < sizeof(m_data); i++) {
+        m_data[i] = rand();
+    }
+}
+
+TEST_TEAR_DOWN(Crc)
+{}
+
+TEST(Crc, CheckValue)
+{
+    // the standard CRC-32 check value, littlefs leaves out the final inversion
+    TEST_ASSERT_EQUAL_HEX32(0xCBF43926, ~lfs_crc(0xFFFFFFFF, "123456789", 9));
+}
+
+TEST(Crc, MatchesReference)
+{
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t size = 0; size <= 1100; size++) {
+            uint32_t seed = size * 2654435761u;
+            TEST_ASSERT_EQUAL_HEX32(reference_crc(seed, m_data + offset, size), lfs_crc(seed, m_data + offset, size));
+        }
+    }
+    TEST_ASSERT_EQUAL_HEX32(reference_crc(0xFFFFFFFF, m_data, 4096), lfs_crc(0xFFFFFFFF, m_data, 4096));
+}
+
+TEST(Crc, Chains)
+{
+    uint32_t whole = lfs_crc(0xFFFFFFFF, m_data, 4096);
+    for (size_t split = 0; split <= 4096; split += 13) {
+        uint32_t crc = lfs_crc(0xFFFFFFFF, m_data, split);
+        TEST_ASSERT_EQUAL_HEX32(whole, lfs_crc(crc, m_data + split, 4096 - split));
+    }
+}
+
+TEST_GROUP_RUNNER(Crc)
+{
+    RUN_TEST_CASE(Crc, CheckValue);
+    RUN_TEST_CASE(Crc, MatchesReference);
+    RUN_TEST_CASE(Crc, Chains);
+}
@@ -0,0 +1,105 @@
+#include "unity_fixture.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bd_file.h"
+#include "vfs_lfs.h"
+
+// Images past 4 GiB, kept sparse so that they cost next to nothing on disk.
+#define BLOCK_SIZE 4096
+#define GIB (UINT64_C(1) << 30)
+
+static char m_image[] = "/tmp/lfs-tool-test-XXXXXX";
+
+TEST_GROUP(LargeImage);
+
+TEST_SETUP(LargeImage)
+{
+    strcpy(m_image, "/tmp/lfs-tool-test-XXXXXX");
+    int fd = mkstemp(m_image);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+}
+
+TEST_TEAR_DOWN(LargeImage)
+{
+    unlink(m_image);
+}
+
+TEST(LargeImage, BlockPastFourGiB)
+{
+    const size_t block_count = 5 * GIB / BLOCK_SIZE;
+    const uint32_t block = block_count - 16;
+    const char data[] = "past the 32-bit horizon";
+    char buffer[sizeof(data)] = {0};
+
+    struct bd *bd = bd_file_get(m_image, BD_MODE_CREATE, 0, BLOCK_SIZE, block_count);
+    TEST_ASSERT_NOT_NULL(bd);
+    TEST_ASSERT_EQUAL_INT(0, bd->erase(bd, block));
+    TEST_ASSERT_EQUAL_INT(0, bd->prog(bd, block, 100, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_INT(0, bd->close(bd));
+
+    int fd = open(m_image, O_RDONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL_UINT64(5 * GIB, (uint64_t)lseek(fd, 0, SEEK_END));
+    ssize_t bytes = pread(fd, buffer, sizeof(buffer), (off_t)block * BLOCK_SIZE + 100);
+    close(fd);
+    TEST_ASSERT_EQUAL_INT(sizeof(buffer), bytes);
+    TEST_ASSERT_EQUAL_STRING(data, buffer);
+}
+
+TEST(LargeImage, PartitionPastFourGiB)
+{
+    const char data[] = "hello from the far end of the image";
+    char buffer[sizeof(data)] = {0};
+
+    // an existing 6 GiB image with a 1 MiB partition 5 GiB in
+    TEST_ASSERT_EQUAL_INT(0, truncate(m_image, 6 * GIB));
+
+    struct vfs_lfs_options options = {
+        .image = m_image,
+        .write = true,
+        .block_size = BLOCK_SIZE,
+        .backend = BD_TYPE_FILE,
+        .offset = 5 * GIB,
+        .length = 1 << 20,
+        .in_place = true,
+    };
+
+    struct vfs *vfs = vfs_lfs_get(&options);
+    TEST_ASSERT_NOT_NULL(vfs);
+    TEST_ASSERT_EQUAL_INT(0, vfs->mount(vfs));
+    void *file = vfs->open(vfs, "/file", O_CREAT | O_TRUNC | O_WRONLY);
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_INT(sizeof(data), vfs->write(vfs, file, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_INT(0, vfs->close(vfs, file));
+    TEST_ASSERT_EQUAL_INT(0, vfs->unmount(vfs));
+
+    options.write = false;
+    vfs = vfs_lfs_get(&options);
+    TEST_ASSERT_NOT_NULL(vfs);
+    TEST_ASSERT_EQUAL_INT(0, vfs->mount(vfs));
+    file = vfs->open(vfs, "/file", O_RDONLY);
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_INT(sizeof(buffer), vfs->read(vfs, file, buffer, sizeof(buffer)));
+    TEST_ASSERT_EQUAL_INT(0, vfs->close(vfs, file));
+    TEST_ASSERT_EQUAL_INT(0, vfs->unmount(vfs));
+    TEST_ASSERT_EQUAL_STRING(data, buffer);
+
+    // the partition did not move or grow the image
+    int fd = open(m_image, O_RDONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL_UINT64(6 * GIB, (uint64_t)lseek(fd, 0, SEEK_END));
+    close(fd);
+}
+
+TEST_GROUP_RUNNER(LargeImage)
+{
+    RUN_TEST_CASE(LargeImage, BlockPastFourGiB);
+    RUN_TEST_CASE(LargeImage, PartitionPastFourGiB);
+}
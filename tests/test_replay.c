@@ -0,0 +1,163 @@
+#include "unity_fixture.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "vfs_lfs.h"
+
+// A build is traced, then its calls run again against a fresh image without littlefs on top.
+#define BLOCK_SIZE 4096
+#define BLOCK_COUNT 32
+#define IO_SIZE 512
+
+// what a replay programs, it has no data of its own
+#define REPLAY_BYTE 0x5A
+
+static char m_image[] = "/tmp/lfs-tool-test-XXXXXX";
+static char m_trace[] = "/tmp/lfs-tool-test-XXXXXX";
+static uint8_t m_data[5 * BLOCK_SIZE];
+static uint8_t m_expected[BLOCK_COUNT][BLOCK_SIZE];
+
+static void make_temp(char *path)
+{
+    strcpy(path, "/tmp/lfs-tool-test-XXXXXX");
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+}
+
+static struct vfs_lfs_options options_for(const char *trace)
+{
+    struct vfs_lfs_options options = {
+        .image = m_image,
+        .write = true,
+        .io_size = IO_SIZE,
+        .block_size = BLOCK_SIZE,
+        .block_count = BLOCK_COUNT,
+        .backend = BD_TYPE_FILE,
+        .trace = trace,
+    };
+    return options;
+}
+
+static void build_traced(void)
+{
+    struct vfs_lfs_options options = options_for(m_trace);
+
+    struct vfs *vfs = vfs_lfs_get(&options);
+    TEST_ASSERT_NOT_NULL(vfs);
+    TEST_ASSERT_EQUAL_INT(0, vfs->mount(vfs));
+    void *file = vfs->open(vfs, "/file", O_CREAT | O_TRUNC | O_WRONLY);
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_INT(sizeof(m_data), vfs->write(vfs, file, m_data, sizeof(m_data)));
+    TEST_ASSERT_EQUAL_INT(0, vfs->close(vfs, file));
+    TEST_ASSERT_EQUAL_INT(0, vfs->unmount(vfs));
+}
+
+TEST_GROUP(Replay);
+
+TEST_SETUP(Replay)
+{
+    make_temp(m_image);
+    make_temp(m_trace);
+
+    for (size_t i = 0; i < sizeof(m_data); i++) {
+        m_data[i] = i * 13;
+    }
+}
+
+TEST_TEAR_DOWN(Replay)
+{
+    unlink(m_image);
+    unlink(m_trace);
+}
+
+TEST(Replay, RecordedBuild)
+{
+    build_traced();
+
+    // the header carries the geometry, the records end in the device state the replay has to reproduce
+    struct trace_header header = {0};
+    struct trace *trace = trace_open(m_trace, &header);
+    TEST_ASSERT_NOT_NULL(trace);
+    TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, header.block_size);
+    TEST_ASSERT_EQUAL_UINT32(BLOCK_COUNT, header.block_count);
+    TEST_ASSERT_EQUAL_UINT32(IO_SIZE, header.prog_size);
+    TEST_ASSERT_TRUE(header.write);
+
+    unsigned counts[TRACE_OP_SYNC + 1] = {0};
+    struct trace_record record = {0};
+    int err;
+
+    memset(m_expected, 0xFF, sizeof(m_expected));
+    while ((err = trace_read(trace, &record)) == 1) {
+        TEST_ASSERT_TRUE(record.block < BLOCK_COUNT);
+        counts[record.op]++;
+        if (record.op == TRACE_OP_ERASE) {
+            memset(m_expected[record.block], 0xFF, BLOCK_SIZE);
+        } else if (record.op == TRACE_OP_PROG) {
+            memset(&m_expected[record.block][record.off], REPLAY_BYTE, record.size);
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(0, err);
+    TEST_ASSERT_EQUAL_INT(0, trace_close(trace));
+
+    TEST_ASSERT_TRUE(counts[TRACE_OP_READ] > 0);
+    TEST_ASSERT_TRUE(counts[TRACE_OP_PROG] >= sizeof(m_data) / IO_SIZE);
+    TEST_ASSERT_TRUE(counts[TRACE_OP_ERASE] > 0);
+    TEST_ASSERT_TRUE(counts[TRACE_OP_SYNC] > 0);
+
+    struct vfs_lfs_options options = options_for(NULL);
+    TEST_ASSERT_EQUAL_INT(0, vfs_lfs_replay(&options, m_trace));
+
+    static uint8_t image[BLOCK_COUNT][BLOCK_SIZE];
+    int fd = open(m_image, O_RDONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    ssize_t bytes = pread(fd, image, sizeof(image), 0);
+    close(fd);
+    TEST_ASSERT_EQUAL_INT(sizeof(image), bytes);
+
+    for (uint32_t block = 0; block < BLOCK_COUNT; block++) {
+        TEST_ASSERT_EQUAL_MEMORY(m_expected[block], image[block], BLOCK_SIZE);
+    }
+}
+
+TEST(Replay, RecordedExtraction)
+{
+    build_traced();
+
+    // reads replay against the image they were traced on
+    struct vfs_lfs_options options = options_for(m_trace);
+    options.write = false;
+
+    struct vfs *vfs = vfs_lfs_get(&options);
+    TEST_ASSERT_NOT_NULL(vfs);
+    TEST_ASSERT_EQUAL_INT(0, vfs->mount(vfs));
+    void *file = vfs->open(vfs, "/file", O_RDONLY);
+    TEST_ASSERT_NOT_NULL(file);
+    static uint8_t buffer[sizeof(m_data)];
+    TEST_ASSERT_EQUAL_INT(sizeof(buffer), vfs->read(vfs, file, buffer, sizeof(buffer)));
+    TEST_ASSERT_EQUAL_INT(0, vfs->close(vfs, file));
+    TEST_ASSERT_EQUAL_INT(0, vfs->unmount(vfs));
+    TEST_ASSERT_EQUAL_MEMORY(m_data, buffer, sizeof(m_data));
+
+    struct trace_header header = {0};
+    struct trace *trace = trace_open(m_trace, &header);
+    TEST_ASSERT_NOT_NULL(trace);
+    TEST_ASSERT_FALSE(header.write);
+    TEST_ASSERT_EQUAL_INT(0, trace_close(trace));
+
+    options.trace = NULL;
+    TEST_ASSERT_EQUAL_INT(0, vfs_lfs_replay(&options, m_trace));
+}
+
+TEST_GROUP_RUNNER(Replay)
+{
+    RUN_TEST_CASE(Replay, RecordedBuild);
+    RUN_TEST_CASE(Replay, RecordedExtraction);
+}